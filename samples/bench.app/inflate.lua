@@ -0,0 +1,70 @@
+-- Time decoding small and large payloads with the ways miniz can size the
+-- output: no hint, the exact size, or a reused buffer.
+--
+--   luvi samples/bench.app -- inflate [runs]
+--
+-- Small payloads run `runs` times, larger ones proportionally fewer times so
+-- each takes about as long.
+
+local uv = require('uv')
+local miniz = require('miniz')
+local bundle = require('luvi').bundle
+
+local function payload(size)
+  local text = bundle.readfile("main.lua")
+  local parts = {}
+  local total = 0
+  while total < size do
+    parts[#parts + 1] = text
+    total = total + #text
+  end
+  return table.concat(parts):sub(1, size)
+end
+
+local function time(label, runs, bytes, fn)
+  fn() -- warm up
+  local start = uv.hrtime()
+  for _ = 1, runs do fn() end
+  local elapsed = (uv.hrtime() - start) / 1e9
+  print(string.format("    %-22s %9.2f us/op %9.1f MB/s", label,
+    elapsed / runs * 1e6, bytes * runs / elapsed / 1e6))
+end
+
+return function (args)
+  local runs = tonumber(args[1]) or 20000
+  for _, size in ipairs({ 1024, 64 * 1024, 4 * 1024 * 1024 }) do
+    local original = payload(size)
+    local compressed = assert(miniz.compress(original))
+    local n = math.max(math.floor(runs * 1024 / size), 5)
+    print(string.format("%d bytes (%d compressed), %d runs", size, #compressed, n))
+
+    local inflator = miniz.new_inflator()
+    local buffer = miniz.new_buffer()
+    time("inflate", n, size, function ()
+      inflator:reset()
+      assert(#inflator:inflate(compressed, "finish") == size)
+    end)
+    time("inflate, size hint", n, size, function ()
+      inflator:reset()
+      assert(#inflator:inflate(compressed, "finish", size) == size)
+    end)
+    time("inflate into buffer", n, size, function ()
+      inflator:reset()
+      assert(inflator:inflate(compressed, "finish", buffer) == size)
+    end)
+    time("uncompress", n, size, function ()
+      assert(#miniz.uncompress(compressed) == size)
+    end)
+    time("uncompress, size hint", n, size, function ()
+      assert(#miniz.uncompress(compressed, size) == size)
+    end)
+    time("uncompress into buffer", n, size, function ()
+      assert(miniz.uncompress(compressed, buffer) == size)
+    end)
+    local deflator = miniz.new_deflator()
+    time("deflate", n, size, function ()
+      deflator:reset()
+      assert(deflator:deflate(original, "finish"))
+    end)
+  end
+end
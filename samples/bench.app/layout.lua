@@ -0,0 +1,59 @@
+-- Compare cold bundle access for the same app zipped with every file
+-- deflated (the old buildBundle default) and with every file stored.
+--
+--   luvi samples/bench.app -- layout [app folder] [runs]
+--
+-- Each run opens the zip, then stats and reads every file in it, which is
+-- what a startup require storm does.
+
+local uv = require('uv')
+local miniz = require('miniz')
+local luviBundle = require('luvibundle')
+local pathJoin = require('luvipath').pathJoin
+
+local function collect(bundle, path, files)
+  for _, name in ipairs(bundle.readdir(path) or {}) do
+    local child = pathJoin(path, name)
+    local stat = bundle.stat(child)
+    if stat.type == "directory" then
+      collect(bundle, child, files)
+    elseif stat.type == "file" then
+      files[#files + 1] = { path = child, data = bundle.readfile(child) }
+    end
+  end
+  return files
+end
+
+return function (args)
+  local source = pathJoin(uv.cwd(), args[1] or "samples/test.app")
+  local runs = tonumber(args[2]) or 200
+  local files = collect(luviBundle.folderBundle(source), "", {})
+  print(string.format("%d files from %s, %d runs", #files, source, runs))
+
+  for _, layout in ipairs({ { "deflate", 9 }, { "store", 0 } }) do
+    local name, level = layout[1], layout[2]
+    local writer = miniz.new_writer()
+    for i = 1, #files do
+      writer:add(files[i].path, files[i].data, level)
+    end
+    local zip = writer:finalize()
+    local path = pathJoin(uv.os_tmpdir(), "luvi-bench-" .. name .. ".zip")
+    local fd = assert(uv.fs_open(path, "w", 384)) -- 0600
+    uv.fs_write(fd, zip, 0)
+    uv.fs_close(fd)
+
+    local start = uv.hrtime()
+    for _ = 1, runs do
+      local bundle = luviBundle.zipBundle(path, assert(miniz.new_reader(path, 0, "mmap")))
+      for i = 1, #files do
+        bundle.stat(files[i].path)
+        assert(bundle.readfile(files[i].path) == files[i].data)
+      end
+      bundle = nil
+      collectgarbage()
+    end
+    local elapsed = uv.hrtime() - start
+    print(string.format("  %-8s %9d bytes %9.3f ms/run", name, #zip, elapsed / runs / 1e6))
+    uv.fs_unlink(path)
+  end
+end
@@ -0,0 +1,42 @@
+--[[
+
+Copyright 2014 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+-- Micro benchmarks for luvi internals.
+--
+--   luvi samples/bench.app -- <name> [benchmark args]
+--
+-- Each benchmark lives in <name>.lua and returns a function taking the
+-- remaining arguments.
+
+local bundle = require('luvi').bundle
+
+local name = args[1]
+if not name or not bundle.stat(name .. ".lua") then
+  print("Usage: " .. args[0] .. " samples/bench.app -- <benchmark> [args]")
+  print("Benchmarks:")
+  for _, file in ipairs(bundle.readdir("")) do
+    local benchmark = file:match("^(.+)%.lua$")
+    if benchmark and benchmark ~= "main" then
+      print("  " .. benchmark)
+    end
+  end
+  return 1
+end
+
+bundle.register(name, name .. ".lua")
+return require(name)({ unpack(args, 2) })
@@ -0,0 +1,102 @@
+-- Time launching an app built with and without a startup manifest.
+--
+--   luvi samples/bench.app -- startup [app folder] [runs]
+--
+-- Without an app folder a synthetic app is generated: main.lua loading 200
+-- modules, with 2000 assets it never reads filling up the rest of the zip.
+-- Page caches are dropped before each launch when running as root,
+-- otherwise the numbers are for a warm cache.
+
+local uv = require('uv')
+local pathJoin = require('luvipath').pathJoin
+
+local function writeFile(path, data)
+  local fd = assert(uv.fs_open(path, "w", 420)) -- 0644
+  uv.fs_write(fd, data, 0)
+  uv.fs_close(fd)
+end
+
+local function run(file, args, env)
+  local code
+  local start = uv.hrtime()
+  local handle = assert(uv.spawn(file, { args = args, env = env }, function (status)
+    code = status
+  end))
+  repeat uv.run("once") until code
+  local elapsed = (uv.hrtime() - start) / 1e6
+  handle:close()
+  return elapsed, code
+end
+
+local function dropCaches()
+  local fd = uv.fs_open("/proc/sys/vm/drop_caches", "w", 420)
+  if not fd then return false end
+  uv.fs_write(fd, "3", 0)
+  uv.fs_close(fd)
+  return true
+end
+
+local function generateApp(base)
+  local app = pathJoin(base, "app")
+  for _, dir in ipairs({ app, pathJoin(app, "assets"), pathJoin(app, "lib") }) do
+    assert(uv.fs_mkdir(dir, 493)) -- 0755
+  end
+  local filler = string.rep("local x = { 'some', 'module', 'body' }\n", 100)
+  for i = 1, 200 do
+    writeFile(pathJoin(app, "lib/m" .. i .. ".lua"), filler .. "return " .. i .. "\n")
+  end
+  for i = 1, 2000 do
+    local data = {}
+    for j = 1, 2048 do
+      data[j] = string.char((i * 7 + j * 13) % 256)
+    end
+    writeFile(pathJoin(app, "assets/a" .. i .. ".dat"), table.concat(data))
+  end
+  writeFile(pathJoin(app, "main.lua"), [[
+local bundle = require('luvi').bundle
+for i = 1, 200 do
+  assert(loadstring(bundle.readfile("lib/m" .. i .. ".lua")))()
+end
+]])
+  return app
+end
+
+local function median(list)
+  table.sort(list)
+  return list[math.ceil(#list / 2)]
+end
+
+return function (args)
+  local runs = tonumber(args[2]) or 20
+  local luvi = uv.exepath()
+  local base = assert(uv.fs_mkdtemp(pathJoin(uv.os_tmpdir(), "luvi-startup-XXXXXX")))
+  local app = args[1] and pathJoin(uv.cwd(), args[1]) or generateApp(base)
+  local plain = pathJoin(base, "plain")
+  local hot = pathJoin(base, "hot")
+  local manifest = pathJoin(base, "manifest.txt")
+
+  print("Building " .. app)
+  assert(select(2, run(luvi, { app, "-o", plain, "--clean" })) == 0, "build failed")
+  assert(select(2, run(plain, {}, { "LUVI_STARTUP_MANIFEST=" .. manifest })) == 0, "run failed")
+  assert(select(2, run(luvi, { app, "-o", hot, "--clean", "--manifest", manifest })) == 0, "build failed")
+
+  -- Dirty pages survive drop_caches
+  for _, file in ipairs({ plain, hot }) do
+    local fd = assert(uv.fs_open(file, "r", 0))
+    uv.fs_fsync(fd)
+    uv.fs_close(fd)
+  end
+  local cold = dropCaches()
+  local times = { plain = {}, hot = {} }
+  for _ = 1, runs do
+    for _, name in ipairs({ "plain", "hot" }) do
+      if cold then dropCaches() end
+      times[name][#times[name] + 1] = run(name == "plain" and plain or hot, {})
+    end
+  end
+  print(string.format("%d launches each, %s page cache", runs, cold and "cold" or "warm (not root)"))
+  for _, name in ipairs({ "plain", "hot" }) do
+    print(string.format("  %-6s median %8.2f ms", name, median(times[name])))
+  end
+  print("Binaries and manifest are left in " .. base)
+end
@@ -139,6 +139,128 @@ for i = 1, #tests, 2 do
   assert(deepEqual(expected, actual), "ERROR: readdir(" .. path .. ")")
 end
 
+print("Testing bundle.open")
+do
+  local stream = assert(bundle.open("sonnet-133.txt"))
+  local parts = {}
+  repeat
+    local chunk = stream.read(100)
+    assert(not chunk or #chunk <= 100)
+    parts[#parts + 1] = chunk
+  until not chunk
+  stream.close()
+  assert(table.concat(parts) == bundle.readfile("sonnet-133.txt"))
+  assert(bundle.open("missing.txt") == nil)
+  assert(bundle.open("add") == nil)
+end
+
+print("Testing bundle.raw")
+do
+  local text = bundle.readfile("sonnet-133.txt")
+  local raw = assert(bundle.raw("sonnet-133.txt"))
+  assert(raw.size == #text and raw.crc32 == require('miniz').crc32(0, text))
+  if raw.method == 0 then assert(raw.data == text) end
+  raw = assert(bundle.raw("sonnet-133.txt", false))
+  assert(raw.data == nil and raw.file and raw.length == raw.comp_size)
+  assert(bundle.raw("add") == nil)
+end
+
+if bundle.load then
+  print("Testing bundle.load")
+  -- The second load comes from the bytecode cache when it's enabled
+  for _ = 1, 2 do
+    local fn = assert(bundle.load("add/init.lua", "@bundle:add/init.lua"))
+    assert(fn()(1, 2) == 3)
+  end
+  assert(bundle.load("missing.lua", "@bundle:missing.lua") == nil)
+end
+
+print("Testing bundle.action")
+do
+  local function echo(path, ...) return path, ... end
+  -- Real paths and bundled files get the same extra arguments
+  local path, a, b = bundle.action(uv.exepath(), echo, "a", "b")
+  assert(path == uv.exepath() and a == "a" and b == "b")
+  path, a, b = bundle.action("greetings.txt", echo, "a", "b")
+  assert(path and a == "a" and b == "b")
+end
+
+print("Testing luvi.readfile")
+do
+  local readfile = require('luvi').readfile
+  local path = require('luvipath').pathJoin(uv.os_tmpdir(), "luvi-readfile-test.txt")
+  local content = string.rep("0123456789", 1000)
+  local fd = assert(uv.fs_open(path, "w", 384))
+  uv.fs_write(fd, content, 0)
+  uv.fs_close(fd)
+  local data, stat = readfile(path)
+  assert(data == content)
+  assert(stat.type == "file" and stat.size == #content and stat.mtime.sec > 0)
+  uv.fs_unlink(path)
+  assert(readfile(path) == nil)
+  data, stat = readfile(uv.os_tmpdir())
+  assert(data == nil and stat.type == "directory")
+end
+
+if require('luvi').memfd then
+  print("Testing luvi.memfd")
+  local path, fd = require('luvi').memfd("test.so", "not really a library")
+  if path then
+    assert(require('luvi').readfile(path) == "not really a library")
+    uv.fs_close(fd)
+  end
+end
+
+print("Testing layered bundles")
+do
+  local pathJoin = require('luvipath').pathJoin
+  local top = pathJoin(uv.os_tmpdir(), "luvi-layer-top")
+  local bottom = pathJoin(uv.os_tmpdir(), "luvi-layer-bottom")
+  local function write(path, data)
+    local fd = assert(uv.fs_open(path, "w", 420))
+    uv.fs_write(fd, data, 0)
+    uv.fs_close(fd)
+  end
+  for _, dir in ipairs({ top, bottom }) do
+    uv.fs_mkdir(dir, 493)
+    uv.fs_mkdir(pathJoin(dir, "lib"), 493)
+  end
+  write(pathJoin(top, "lib/shared.lua"), "top")
+  write(pathJoin(bottom, "lib/shared.lua"), "bottom")
+  write(pathJoin(bottom, "lib/only.lua"), "only")
+  -- A directory in an upper layer doesn't hide a file of a lower one
+  uv.fs_mkdir(pathJoin(top, "lib/thing"), 493)
+  write(pathJoin(bottom, "lib/thing"), "thing")
+  local layered = require('luvibundle').makeBundle({ top, bottom })
+  assert(layered.readfile("lib/shared.lua") == "top")
+  assert(layered.readfile("/lib/../lib/only.lua") == "only")
+  assert(layered.stat("lib/thing").type == "directory")
+  assert(layered.readfile("lib/thing") == "thing")
+  assert(layered.stat("lib/new.lua") == nil)
+  local list = layered.readdir("lib")
+  table.sort(list)
+  assert(deepEqual({ "only.lua", "shared.lua", "thing" }, list))
+  -- Cached misses and listings are dropped when a folder layer changes
+  write(pathJoin(top, "lib/new.lua"), "new")
+  local timer = uv.new_timer()
+  local waited = 0
+  timer:start(10, 10, function ()
+    waited = waited + 10
+    if layered.stat("lib/new.lua") or waited >= 2000 then timer:close() end
+  end)
+  uv.run()
+  assert(layered.readfile("lib/new.lua") == "new")
+  assert(#layered.readdir("lib") == 4)
+  uv.fs_rmdir(pathJoin(top, "lib/thing"))
+  for _, dir in ipairs({ top, bottom }) do
+    for _, name in ipairs({ "shared.lua", "only.lua", "new.lua", "thing" }) do
+      uv.fs_unlink(pathJoin(dir, "lib", name))
+    end
+    uv.fs_rmdir(pathJoin(dir, "lib"))
+    uv.fs_rmdir(dir)
+  end
+end
+
 if _VERSION=="Lua 5.2" then
   print("Testing for lua 5.2 extensions")
   local thread, ismain = coroutine.running()
@@ -164,6 +286,54 @@ if reader then
   end
 end
 
+do
+  print("Testing mmap reader")
+  local mapped = miniz.new_reader(uv.exepath(), 0, "mmap")
+  if mapped and reader then
+    assert(mapped:get_offset() == reader:get_offset())
+    assert(mapped:get_num_files() == reader:get_num_files())
+    for i = 1, reader:get_num_files() do
+      assert(mapped:extract(i) == reader:extract(i), "mapped extract mismatch")
+    end
+  end
+
+  print("Testing extract into buffer")
+  if reader then
+    local buffer = miniz.new_buffer()
+    for i = 1, reader:get_num_files() do
+      local data = reader:extract(i)
+      assert(reader:extract_into(i, buffer) == #data)
+      assert(#buffer == #data and buffer:capacity() >= #data)
+      assert(buffer:tostring() == data, "buffer extract mismatch")
+      assert(buffer:tostring(2, 5) == data:sub(2, 5))
+    end
+  end
+
+  print("Testing entry streams")
+  if reader then
+    for i = 1, reader:get_num_files() do
+      local stream = assert(reader:open_stream(i))
+      local parts = {}
+      repeat
+        local chunk = stream:read(1000)
+        parts[#parts + 1] = chunk
+      until not chunk
+      assert(table.concat(parts) == reader:extract(i), "streamed extract mismatch")
+    end
+  end
+
+  print("Testing raw entries")
+  if reader then
+    for i = 1, reader:get_num_files() do
+      local raw = assert(reader:raw(i))
+      assert(#raw.data == raw.length and raw.length == raw.comp_size)
+      local data = raw.method == 0 and raw.data or miniz.inflate(raw.data)
+      assert(data == reader:extract(i), "raw entry mismatch")
+      assert(miniz.crc32(0, data) == raw.crc32)
+    end
+  end
+end
+
 writer:add("README.md", "# A Readme\n\nThis is neat?", 9)
 writer:add("data.json", '{"name":"Tim","age":32}\n', 9)
 writer:add("a/big/file.dat", string.rep("12345\n", 10000), 9)
@@ -171,6 +341,353 @@ writer:add("main.lua", 'print(require("luvi").version)', 9)
 
 p("zip bytes", #writer:finalize())
 
+do
+  print("Testing file and callback writers")
+  local files = {
+    { "README.md", "# A Readme\n\nThis is neat?" },
+    { "a/big/file.dat", string.rep("12345\n", 10000) },
+  }
+  local path = require('luvipath').pathJoin(uv.os_tmpdir(), "luvi-writer-test.zip")
+  local fd = assert(uv.fs_open(path, "w+", 384))
+  assert(uv.fs_write(fd, "prefix", 0))
+  local fileWriter = miniz.new_file_writer(fd, 6)
+  local chunks = {}
+  local callbackWriter = miniz.new_callback_writer(function (chunk)
+    chunks[#chunks + 1] = chunk
+  end)
+  for _, file in ipairs(files) do
+    fileWriter:add(file[1], file[2], 9)
+    callbackWriter:add(file[1], file[2], 9)
+  end
+  assert(#chunks == #files, "callback writer should flush each entry")
+  local size = fileWriter:finalize()
+  assert(callbackWriter:finalize() == #table.concat(chunks))
+  uv.fs_close(fd)
+  assert(uv.fs_stat(path).size == size + 6)
+  local fromFile = assert(miniz.new_reader(path))
+  for i, file in ipairs(files) do
+    assert(fromFile:extract(i) == file[2])
+  end
+  fromFile = nil
+  collectgarbage()
+  fd = assert(uv.fs_open(path, "w", 384))
+  uv.fs_write(fd, table.concat(chunks), 0)
+  uv.fs_close(fd)
+  local fromCallback = assert(miniz.new_reader(path))
+  for i, file in ipairs(files) do
+    assert(fromCallback:extract(i) == file[2])
+  end
+  fromCallback = nil
+  collectgarbage()
+  uv.fs_unlink(path)
+end
+
+do
+  print("Testing bundle trailers")
+  local path = require('luvipath').pathJoin(uv.os_tmpdir(), "luvi-trailer-test.zip")
+  local fd = assert(uv.fs_open(path, "w+", 384))
+  assert(uv.fs_write(fd, "binary", 0))
+  assert(miniz.probe(path) == nil, "plain files have no zip")
+  local writer = miniz.new_file_writer(fd, 6)
+  writer:add("main.lua", "print('hi')", 9)
+  local size = writer:finalize()
+  local found = assert(miniz.probe(path))
+  assert(found.offset == 6 and found.files == 1 and found.hash == nil)
+  local newSize, hash = miniz.append_trailer(fd, 6, size)
+  uv.fs_close(fd)
+  assert(uv.fs_stat(path).size == newSize + 6)
+  found = assert(miniz.probe(path))
+  assert(found.offset == 6 and found.files == 1 and found.hash == hash)
+  assert(found.cdir_offset + found.cdir_size < newSize + 6)
+  for _, mode in ipairs({ "read", "mmap" }) do
+    local reader = assert(miniz.new_reader(path, 0, mode))
+    assert(reader:get_offset() == 6)
+    assert(reader:extract(1) == "print('hi')")
+  end
+  -- Zip64 archives get a trailer as well
+  fd = assert(uv.fs_open(path, "w+", 384))
+  assert(uv.fs_write(fd, "binary", 0))
+  writer = miniz.new_file_writer(fd, 6)
+  for i = 1, 70000 do
+    writer:add("f" .. i, "", 0)
+  end
+  size = writer:finalize()
+  found = assert(miniz.probe(path))
+  assert(found.offset == 6 and found.files == 70000)
+  newSize, hash = miniz.append_trailer(fd, 6, size)
+  uv.fs_close(fd)
+  found = assert(miniz.probe(path))
+  assert(found.offset == 6 and found.files == 70000 and found.hash == hash)
+  local reader = assert(miniz.new_reader(path, 0, "mmap"))
+  assert(reader:get_offset() == 6 and reader:get_num_files() == 70000)
+  reader = nil
+  collectgarbage()
+  -- A zip with its own comment is only found by searching for it
+  writer = miniz.new_writer()
+  writer:add("main.lua", "print('hi')", 9)
+  local zip = writer:finalize()
+  fd = assert(uv.fs_open(path, "w", 384))
+  assert(uv.fs_write(fd, "binary" .. zip:sub(1, -3) .. "\5\0hello", 0))
+  uv.fs_close(fd)
+  assert(miniz.probe(path) == nil)
+  local commented = assert(miniz.new_reader(path, 0, "mmap"))
+  assert(commented:get_offset() == 6 and commented:extract(1) == "print('hi')")
+  commented = nil
+  collectgarbage()
+  uv.fs_unlink(path)
+end
+
+do
+  print("Testing bundle module maps")
+  local path = require('luvipath').pathJoin(uv.os_tmpdir(), "luvi-modules-test.zip")
+  local writer = miniz.new_writer()
+  writer:add("deps/greet/init.lua", "return function (name) return 'hi ' .. name end", 9)
+  writer:add(".luvi/modules", "greet\tdeps/greet/init.lua\n", 0)
+  local fd = assert(uv.fs_open(path, "w", 384))
+  uv.fs_write(fd, writer:finalize(), 0)
+  uv.fs_close(fd)
+  local other = require('luvipath').pathJoin(uv.os_tmpdir(), "luvi-modules-test2.zip")
+  writer = miniz.new_writer()
+  writer:add("libs/hello.lua", "return 'hello'", 9)
+  writer:add(".luvi/modules", "hello\tlibs/hello.lua\ngreet\tlibs/hello.lua\n", 0)
+  fd = assert(uv.fs_open(other, "w", 384))
+  uv.fs_write(fd, writer:finalize(), 0)
+  uv.fs_close(fd)
+  local luvibundle = require('luvibundle')
+  local zipped = luvibundle.zipBundle(path, assert(miniz.new_reader(path)))
+  assert(zipped.modulePath("greet") == "deps/greet/init.lua")
+  assert(zipped.modulePath("missing") == nil)
+  -- Layers are asked in order
+  local layered = luvibundle.makeBundle({ path, other })
+  assert(layered.modulePath("greet") == "deps/greet/init.lua")
+  assert(layered.modulePath("hello") == "libs/hello.lua")
+  assert(layered.modulePath("missing") == nil)
+  zipped, layered = nil, nil
+  collectgarbage()
+  uv.fs_unlink(path)
+  uv.fs_unlink(other)
+end
+
+do
+  print("Testing the zip path index")
+  local path = require('luvipath').pathJoin(uv.os_tmpdir(), "luvi-index-test.zip")
+  local writer = miniz.new_writer()
+  writer:add("empty/", "", 0)
+  writer:add("lib/", "", 0)
+  writer:add("lib/util.lua", "return {}", 9)
+  writer:add("lib/deep/nested/mod.lua", "return 'nested'", 9)
+  writer:add("main.lua", "print('main')", 0)
+  local fd = assert(uv.fs_open(path, "w", 384))
+  uv.fs_write(fd, writer:finalize(), 0)
+  uv.fs_close(fd)
+  local reader = assert(miniz.new_reader(path))
+  local function sorted(list)
+    table.sort(list)
+    return list
+  end
+
+  -- Nested directories, including ones only implied by their children
+  assert(deepEqual({ "empty", "lib", "main.lua" }, sorted(assert(reader:readdir("")))))
+  assert(deepEqual({ "deep", "util.lua" }, sorted(assert(reader:readdir("lib")))))
+  assert(deepEqual({ "nested" }, assert(reader:readdir("lib/deep"))))
+  assert(deepEqual({ "mod.lua" }, assert(reader:readdir("./lib/deep/nested/"))))
+  assert(reader:stat_path("lib/deep").type == "directory")
+  assert(reader:locate("lib/deep") == nil, "implied directories have no entry")
+  local index = assert(reader:locate("lib/../lib/deep/nested/mod.lua"))
+  assert(reader:extract(index) == "return 'nested'")
+  local stat = assert(reader:stat_path("lib/util.lua"))
+  assert(stat.type == "file" and stat.size == #"return {}")
+
+  -- Directory entries are found with or without their trailing slash
+  assert(reader:locate("empty") == reader:locate("empty/"))
+  assert(reader:is_directory(assert(reader:locate("lib"))))
+  assert(reader:stat_path("empty/").type == "directory")
+  assert(deepEqual({}, assert(reader:readdir("empty"))))
+
+  -- Missing paths
+  local missing, err = reader:locate("lib/missing.lua")
+  assert(missing == nil and err:find("missing.lua", 1, true))
+  missing, err = reader:stat_path("nope/util.lua")
+  assert(missing == nil and err)
+  missing, err = reader:readdir("lib/deep/missing")
+  assert(missing == nil and err)
+  missing, err = reader:readdir("main.lua")
+  assert(missing == nil and err:find("not a directory", 1, true))
+  reader = nil
+  collectgarbage()
+  uv.fs_unlink(path)
+
+  -- A zip with a single folder at top-level is served from inside it
+  writer = miniz.new_writer()
+  writer:add("app-1.0/", "", 0)
+  writer:add("app-1.0/main.lua", "return 'app'", 9)
+  writer:add("app-1.0/libs/dep.lua", "return 'dep'", 9)
+  writer:add(".hidden", "", 0)
+  fd = assert(uv.fs_open(path, "w", 384))
+  uv.fs_write(fd, writer:finalize(), 0)
+  uv.fs_close(fd)
+  local zipped = require('luvibundle').zipBundle(path, assert(miniz.new_reader(path)))
+  assert(deepEqual({ "libs", "main.lua" }, sorted(assert(zipped.readdir("")))))
+  assert(zipped.readfile("main.lua") == "return 'app'")
+  assert(zipped.readfile("libs/dep.lua") == "return 'dep'")
+  assert(zipped.stat("libs").type == "directory")
+  assert(zipped.stat("app-1.0/main.lua") == nil)
+  zipped = nil
+  collectgarbage()
+  uv.fs_unlink(path)
+end
+
+do
+  print("Testing building from a zip")
+  local pathJoin = require('luvipath').pathJoin
+  local luvibundle = require('luvibundle')
+  local source = pathJoin(uv.os_tmpdir(), "luvi-build-source.zip")
+  local target = pathJoin(uv.os_tmpdir(), "luvi-build-target")
+  local code = "return " .. string.format("%q", string.rep("deflated ", 500))
+  local writer = miniz.new_writer()
+  writer:add("main.lua", code, 9)
+  writer:add("lib/stored.txt", "stored as is", 0)
+  local fd = assert(uv.fs_open(source, "w", 384))
+  uv.fs_write(fd, writer:finalize(), 0)
+  uv.fs_close(fd)
+  luvibundle.buildBundle({ output = target, clean = true, jobs = 2 }, luvibundle.makeBundle({ source }))
+  local built = assert(miniz.new_reader(target))
+  assert(built:extract(built:locate("main.lua")) == code)
+  assert(built:extract(built:locate("lib/stored.txt")) == "stored as is")
+  built = nil
+  collectgarbage()
+  uv.fs_unlink(target)
+  uv.fs_unlink(source)
+end
+
+do
+  print("Testing rebuilding unchanged files")
+  local pathJoin = require('luvipath').pathJoin
+  local luvibundle = require('luvibundle')
+  local source = pathJoin(uv.os_tmpdir(), "luvi-rebuild-source")
+  local target = pathJoin(uv.os_tmpdir(), "luvi-rebuild-target")
+  local names = { "main.lua", "data.txt" }
+  uv.fs_mkdir(source, 493)
+  for _, name in ipairs(names) do
+    local fd = assert(uv.fs_open(pathJoin(source, name), "w", 420))
+    uv.fs_write(fd, "return " .. string.format("%q", string.rep(name, 100)), 0)
+    uv.fs_close(fd)
+  end
+  local options = { output = target, clean = true, jobs = 2 }
+  local first = luvibundle.buildBundle(options, luvibundle.makeBundle({ source }))
+  assert(first.rebuilt == #names)
+  -- Touched files keep their size, so their crc decides whether they changed
+  for _, name in ipairs(names) do
+    uv.fs_utime(pathJoin(source, name), os.time() + 10, os.time() + 10)
+  end
+  options.clean = nil
+  local second = luvibundle.buildBundle(options, luvibundle.makeBundle({ source }))
+  assert(second.reused == #names and second.rebuilt == 0, "unchanged files should be reused")
+  -- Entries reused by their crc get the new mtime in their comment, so the
+  -- next build reuses them without reading the files
+  local reader = assert(miniz.new_reader(target))
+  for _, name in ipairs(names) do
+    local comment = reader:stat(reader:locate(name)).comment
+    local mtime = uv.fs_stat(pathJoin(source, name)).mtime
+    assert(comment:find(" " .. mtime.sec .. ".", 1, true), "comment kept the old mtime")
+  end
+  reader = nil
+  collectgarbage()
+  local third = luvibundle.buildBundle(options, luvibundle.makeBundle({ source }))
+  assert(third.reused == #names and third.rebuilt == 0)
+  for _, name in ipairs(names) do
+    uv.fs_unlink(pathJoin(source, name))
+  end
+  uv.fs_rmdir(source)
+  uv.fs_unlink(target)
+end
+
+do
+  print("Testing deduplicated entries")
+  local content = string.rep("shared dependency\n", 1000)
+  local writer = miniz.new_writer()
+  writer:add("deps/a/lib.lua", content, 9)
+  writer:add("other.txt", "not shared", 9)
+  writer:add_alias("deps/b/lib.lua", 1, "comment")
+  local reader
+  local path = require('luvipath').pathJoin(uv.os_tmpdir(), "luvi-alias-test.zip")
+  local fd = assert(uv.fs_open(path, "w", 384))
+  uv.fs_write(fd, writer:finalize(), 0)
+  uv.fs_close(fd)
+  reader = assert(miniz.new_reader(path))
+  assert(reader:get_num_files() == 3)
+  local a, b = reader:locate("deps/a/lib.lua"), reader:locate("deps/b/lib.lua")
+  assert(reader:raw(a, false).offset == reader:raw(b, false).offset, "alias should share data")
+  assert(reader:stat(b).comment == "comment")
+  local before = miniz.extract_cache(1024 * 1024)
+  assert(reader:extract(a) == content and reader:extract(b) == content)
+  local after = miniz.extract_cache()
+  assert(after.hits > before.hits, "aliases should come from the cache")
+  -- The same content in another file is never served from the cache
+  local copy = path .. ".copy"
+  fd = assert(uv.fs_open(copy, "w", 384))
+  uv.fs_write(fd, assert(require('luvi').readfile(path)), 0)
+  uv.fs_close(fd)
+  local other = assert(miniz.new_reader(copy))
+  assert(other:extract(other:locate("deps/a/lib.lua")) == content)
+  assert(miniz.extract_cache().hits == after.hits, "cache hit across files")
+  miniz.extract_cache(before.limit)
+  reader, other = nil, nil
+  collectgarbage()
+  uv.fs_unlink(path)
+  uv.fs_unlink(copy)
+end
+
+do
+  print("miniz checksums")
+  p(miniz.checksums())
+  -- Check the (possibly SIMD) checksums against plain lua versions, over
+  -- lengths around the vector sizes and unaligned starts.
+  local bit = require('bit')
+  local crcTable = {}
+  for i = 0, 255 do
+    local c = i
+    for _ = 1, 8 do
+      c = bit.band(c, 1) == 1 and bit.bxor(bit.rshift(c, 1), 0xedb88320) or bit.rshift(c, 1)
+    end
+    crcTable[i] = c
+  end
+  local function crc32(data)
+    local c = bit.bnot(0)
+    for i = 1, #data do
+      c = bit.bxor(crcTable[bit.band(bit.bxor(c, data:byte(i)), 0xff)], bit.rshift(c, 8))
+    end
+    return bit.bnot(c) % 4294967296
+  end
+  local function adler32(data)
+    local a, b = 1, 0
+    for i = 1, #data do
+      a = (a + data:byte(i)) % 65521
+      b = (b + a) % 65521
+    end
+    return b * 65536 + a
+  end
+  local bytes = {}
+  for i = 1, 6000 do
+    bytes[i] = string.char((i * 7919 + math.floor(i / 251)) % 256)
+  end
+  local data = table.concat(bytes)
+  for _, len in ipairs({ 0, 1, 15, 16, 31, 32, 63, 64, 65, 127, 128, 200, 1000, 5552, 5553, 5999 }) do
+    local start = len % 7 + 1
+    local chunk = data:sub(start, start + len - 1)
+    assert(miniz.crc32(0, chunk) == crc32(chunk), "crc32 of " .. len .. " bytes")
+    assert(miniz.adler32(1, chunk) == adler32(chunk), "adler32 of " .. len .. " bytes")
+  end
+  -- Feeding the data in pieces gives the same as all at once
+  local crc, adler = 0, 1
+  for i = 1, #data, 1000 do
+    crc = miniz.crc32(crc, data:sub(i, i + 999))
+    adler = miniz.adler32(adler, data:sub(i, i + 999))
+  end
+  assert(crc == miniz.crc32(0, data) and adler == miniz.adler32(1, data))
+  assert(miniz.crc32(0, "123456789") == 0xcbf43926)
+end
+
 do
   print("miniz zlib compression - full data")
   local original = string.rep(bundle.readfile("sonnet-133.txt"), 1000)
@@ -185,6 +702,50 @@ do
   assert(inflated == original, "inflated data doesn't match original")
 end
 
+do
+  print("miniz zlib compression - output sizes")
+  local original = string.rep(bundle.readfile("sonnet-133.txt"), 1000)
+  local compressed = assert(miniz.new_deflator(6):deflate(original, "finish"))
+  -- Exact, too small and no size hints all decode the same
+  for _, size in ipairs({ #original, 100, false }) do
+    local inflated = assert(miniz.new_inflator():inflate(compressed, "finish", size or nil))
+    assert(inflated == original, "inflated data doesn't match original")
+    assert(miniz.uncompress(compressed, size or nil) == original)
+  end
+  local buffer = miniz.new_buffer(16)
+  assert(miniz.new_inflator():inflate(compressed, "finish", buffer) == #original)
+  assert(buffer:tostring() == original)
+  assert(buffer:capacity() >= #original)
+  assert(miniz.uncompress(miniz.compress("reused"), buffer) == 6)
+  assert(buffer:tostring() == "reused")
+  assert(miniz.uncompress(compressed:sub(1, -10), #original) == nil)
+end
+
+do
+  print("miniz zlib compression - stream reuse")
+  local original = bundle.readfile("sonnet-133.txt")
+  local deflator = miniz.new_deflator(9, -15)
+  local first = assert(deflator:deflate(original, "finish"))
+  assert(deflator:reset() == deflator)
+  assert(deflator:deflate(original, "finish") == first, "reset stream gave other output")
+  assert(miniz.inflate(first) == original)
+  local before = miniz.stream_pool()
+  deflator:close()
+  assert(not pcall(deflator.deflate, deflator, original), "closed stream still usable")
+  local after = miniz.stream_pool()
+  assert(after.returns == before.returns + 1)
+  -- The next stream with the same settings gets the pooled state
+  deflator = miniz.new_deflator(9, -15)
+  assert(miniz.stream_pool().hits == after.hits + 1)
+  assert(deflator:deflate(original, "finish") == first, "pooled stream gave other output")
+  local inflator = miniz.new_inflator(-15)
+  assert(inflator:inflate(first, "finish") == original)
+  inflator:reset()
+  assert(inflator:inflate(first, "finish") == original)
+  assert(miniz.stream_pool(0).idle == 0)
+  miniz.stream_pool(4)
+end
+
 do
   print("miniz zlib compression - partial data stream")
   local original_full = bundle.readfile("sonnet-133.txt")
@@ -217,6 +778,74 @@ do
   assert(uncompressed == original, "inflated data doesn't match original")
 end
 
+do
+  print("miniz zlib compression - async")
+  local original = string.rep(bundle.readfile("sonnet-133.txt"), 1000)
+  assert(miniz.async_limit(1) == 1)
+  local results = {}
+  miniz.compress_async(original, 9, function (err, compressed)
+    assert(not err, err)
+    miniz.uncompress_async(compressed, #original, function (err, uncompressed)
+      assert(not err, err)
+      results.callback = uncompressed
+    end)
+  end)
+  local _, running, queued = miniz.async_limit()
+  assert(running == 1 and queued == 0)
+  local deflator = miniz.new_deflator(9)
+  coroutine.wrap(function ()
+    local deflated = assert(deflator:deflate_async(original, "finish"))
+    local inflated = assert(miniz.new_inflator():inflate_async(deflated))
+    results.coroutine = inflated
+  end)()
+  -- With a limit of 1 the coroutine's job waits behind the first one
+  _, running, queued = miniz.async_limit()
+  assert(running == 1 and queued == 1)
+  assert(not pcall(deflator.deflate, deflator, "more"), "stream should be busy")
+  assert(not pcall(miniz.compress_async, original, 99, function () end), "level should be checked")
+  -- Coroutines are resumed directly, not through the global
+  local resume = coroutine.resume
+  coroutine.resume = function () error("global coroutine.resume was used") end
+  uv.run()
+  coroutine.resume = resume
+  miniz.async_limit(2)
+  assert(results.callback == original, "callback result doesn't match")
+  assert(results.coroutine == original, "coroutine result doesn't match")
+end
+
+do
+  print("miniz zlib compression - parallel")
+  local original = string.rep(bundle.readfile("sonnet-133.txt"), 1000)
+  local results = {}
+  for _, format in ipairs({ "zlib", "raw", "gzip" }) do
+    miniz.compress_parallel(original, 6, format, 16384, function (err, compressed)
+      assert(not err, err)
+      results[format] = compressed
+    end)
+  end
+  uv.run()
+  -- Blocks share the async limit with every other job
+  miniz.async_limit(1)
+  miniz.compress_parallel(original, 6, "raw", 16384, 4, function (err, compressed)
+    assert(not err, err)
+    results.limited = compressed
+  end)
+  local _, running, queued = miniz.async_limit()
+  assert(running == 1 and queued == 3, "parallel blocks should wait for the async limit")
+  uv.run()
+  miniz.async_limit(2)
+  assert(results.limited == results.raw, "limited stream doesn't match")
+  local inflated = assert(miniz.new_inflator():inflate(results.zlib, "finish"))
+  assert(inflated == original, "zlib stream doesn't match original")
+  assert(miniz.uncompress(results.zlib, #original) == original)
+  assert(miniz.inflate(results.raw) == original, "raw stream doesn't match original")
+  local gzip = results.gzip
+  assert(gzip:sub(1, 2) == "\31\139")
+  assert(miniz.inflate(gzip:sub(11, -9)) == original, "gzip stream doesn't match original")
+  local b1, b2, b3, b4 = gzip:byte(-8, -5)
+  assert(b1 + b2 * 256 + b3 * 65536 + b4 * 16777216 == miniz.crc32(0, original))
+end
+
 local options = require('luvi').options
 
 if options.zlib then
@@ -248,6 +877,81 @@ if options.rex then
   assert(#colors == 3)
 end
 
+print("Testing vm pool")
+do
+  local luvi = require('luvi')
+  local before = luvi.vm_pool_configure(2)
+  local seen = {}
+  local async = uv.new_async(function (wasLeaked)
+    seen[#seen + 1] = wasLeaked
+  end)
+  for _ = 1, 2 do
+    uv.new_thread(function (notify)
+      local registry = debug.getregistry()
+      notify:send(leaked == true or string.leaked ~= nil or registry.leaked ~= nil)
+      leaked = true
+      string.leaked = true
+      registry.leaked = true
+    end, async):join()
+    uv.run("nowait")
+  end
+  async:close()
+  local stats = luvi.vm_pool_stats()
+  p(stats)
+  assert(stats.hits > before.hits, "second thread should reuse a pooled state")
+  assert(#seen == 2 and not seen[1] and not seen[2], "recycled state kept a global, module field or registry entry")
+  assert(stats.resets > before.resets)
+  luvi.vm_pool_configure(0)
+  assert(luvi.vm_pool_stats().pooled == 0)
+end
+
+print("Testing vm memory accounting")
+do
+  local luvi = require('luvi')
+  local mem = luvi.vm_memory()
+  p(mem)
+  assert(mem.live > 0)
+  if mem.id then
+    local blob = string.rep("x", 1024 * 1024)
+    assert(luvi.vm_memory().live >= mem.live + #blob)
+    local found
+    for _, entry in ipairs(luvi.vm_memory_list()) do
+      if entry.id == mem.id then found = entry end
+    end
+    assert(found, "current state missing from vm_memory_list")
+    -- The main state's budget is what vm_memory_limits reports for it
+    local mainLimit = luvi.vm_memory_limits().main
+    luvi.set_vm_memory_limit("1g")
+    assert(luvi.vm_memory_limits().main == 1024 * 1024 * 1024)
+    luvi.set_vm_memory_limit(mainLimit)
+
+    print("Testing thread memory limits")
+    local limits = luvi.vm_memory_limits()
+    luvi.set_thread_memory_limit("4m")
+    local ok, err = uv.new_thread(function ()
+      local ok, err = pcall(string.rep, "x", 16 * 1024 * 1024)
+      assert(not ok)
+      return tostring(err)
+    end):join()
+    p(ok, err)
+    -- Running out at the top level of a thread only ends that thread
+    uv.new_thread(function ()
+      local blob = string.rep("x", 16 * 1024 * 1024)
+      return #blob
+    end):join()
+    local ticked = false
+    local timer = uv.new_timer()
+    timer:start(1, 0, function ()
+      ticked = true
+      timer:close()
+    end)
+    uv.run()
+    assert(ticked, "main loop stopped after a thread ran out of memory")
+    luvi.set_thread_memory_limit(limits.thread)
+    assert(luvi.vm_memory_limits().hits > limits.hits, "limit hit was not counted")
+  end
+end
+
 print("Testing utf8")
 
 local emoji = "🎃"
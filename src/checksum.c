@@ -0,0 +1,276 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+// crc32 and adler32 for lminiz, the same values as mz_crc32 and mz_adler32.
+// On x86-64 the bulk of a buffer goes through SIMD versions chosen once by
+// what the CPU supports: crc32 folds 64 bytes at a time with carry-less
+// multiplies (PCLMULQDQ; SSE4.2's crc32 instruction computes CRC-32C, not the
+// zip polynomial) and adler32 sums 32 bytes at a time with AVX2 or SSSE3.
+// Short buffers and the last few bytes use miniz's scalar code, which is also
+// all other platforms get. Setting LUVI_SIMD_CHECKSUMS=0 turns SIMD off.
+// miniz is built without the crc checks of its zip reader (see
+// CMakeLists.txt), lminiz checks extracted entries with these instead.
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LMZ_SIMD_CHECKSUMS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef mz_ulong (*lmz_checksum_fn)(mz_ulong, const unsigned char*, size_t);
+
+static lmz_checksum_fn lmz_crc32_impl = mz_crc32;
+static lmz_checksum_fn lmz_adler32_impl = mz_adler32;
+static const char* lmz_crc32_name = "scalar";
+static const char* lmz_adler32_name = "scalar";
+static uv_once_t lmz_checksum_once = UV_ONCE_INIT;
+
+#ifdef LMZ_SIMD_CHECKSUMS
+
+#define LMZ_ADLER_BASE 65521
+// Most bytes that can be summed before s2 overflows 32 bits, as in zlib
+#define LMZ_ADLER_NMAX 5552
+
+// Fold len bytes (at least 64 and a multiple of 16) into crc, without the
+// pre and post inversion. The constants are from Intel's "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction", for the
+// bit reflected zip polynomial.
+__attribute__((target("pclmul,sse4.1")))
+static mz_uint32 lmz_crc32_fold(mz_uint32 crc, const unsigned char* buf, size_t len) {
+  static const mz_uint64 k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+  static const mz_uint64 k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+  static const mz_uint64 k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+  static const mz_uint64 poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  x0 = _mm_load_si128((const __m128i*)k1k2);
+  buf += 64;
+  len -= 64;
+
+  // Four 128 bit lanes in parallel while there are 64 bytes
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    y5 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+    y6 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+    y7 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+    y8 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    buf += 64;
+    len -= 64;
+  }
+
+  // Fold the four lanes into one
+  x0 = _mm_load_si128((const __m128i*)k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // Then the remaining 16 byte blocks
+  while (len >= 16) {
+    x2 = _mm_loadu_si128((const __m128i*)buf);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    buf += 16;
+    len -= 16;
+  }
+
+  // 128 bits to 64
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_load_si128((const __m128i*)poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (mz_uint32)_mm_extract_epi32(x1, 1);
+}
+
+static mz_ulong lmz_crc32_pclmul(mz_ulong crc, const unsigned char* buf, size_t len) {
+  if (buf != NULL && len >= 64) {
+    size_t chunk = len & ~(size_t)15;
+    crc = ~lmz_crc32_fold(~(mz_uint32)crc, buf, chunk) & 0xffffffff;
+    buf += chunk;
+    len -= chunk;
+    if (len == 0) return crc;
+  }
+  return mz_crc32(crc, buf, len);
+}
+
+// Both adler32 versions take 32 byte blocks: s1 gets the sum of the bytes,
+// s2 the bytes weighted 32 down to 1 plus 32 times s1 as it was before the
+// block (tracked in ps). At most NMAX bytes go by between reductions.
+__attribute__((target("ssse3")))
+static mz_ulong lmz_adler32_ssse3(mz_ulong adler, const unsigned char* buf, size_t len) {
+  mz_uint32 s1 = adler & 0xffff;
+  mz_uint32 s2 = (adler >> 16) & 0xffff;
+  size_t blocks;
+  if (buf == NULL || len < 64) return mz_adler32(adler, buf, len);
+  blocks = len / 32;
+  len -= blocks * 32;
+  while (blocks) {
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    size_t n = LMZ_ADLER_NMAX / 32;
+    __m128i v_ps, v_s1, v_s2;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+    v_ps = _mm_set_epi32(0, 0, 0, (int)(s1 * n));
+    v_s2 = _mm_set_epi32(0, 0, 0, (int)s2);
+    v_s1 = zero;
+    do {
+      const __m128i bytes1 = _mm_loadu_si128((const __m128i*)buf);
+      const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      buf += 32;
+    } while (--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 += (mz_uint32)_mm_cvtsi128_si32(v_s1);
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s2 = (mz_uint32)_mm_cvtsi128_si32(v_s2);
+    s1 %= LMZ_ADLER_BASE;
+    s2 %= LMZ_ADLER_BASE;
+  }
+  return mz_adler32(s1 | (s2 << 16), buf, len);
+}
+
+__attribute__((target("avx2")))
+static mz_ulong lmz_adler32_avx2(mz_ulong adler, const unsigned char* buf, size_t len) {
+  mz_uint32 s1 = adler & 0xffff;
+  mz_uint32 s2 = (adler >> 16) & 0xffff;
+  size_t blocks;
+  if (buf == NULL || len < 64) return mz_adler32(adler, buf, len);
+  blocks = len / 32;
+  len -= blocks * 32;
+  while (blocks) {
+    const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                         16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    size_t n = LMZ_ADLER_NMAX / 32;
+    __m256i v_ps, v_s1, v_s2;
+    __m128i sum;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+    v_ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+    v_s2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+    v_s1 = zero;
+    do {
+      const __m256i bytes = _mm256_loadu_si256((const __m256i*)buf);
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+      buf += 32;
+    } while (--n);
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+    sum = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 += (mz_uint32)_mm_cvtsi128_si32(sum);
+    sum = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    s2 = (mz_uint32)_mm_cvtsi128_si32(sum);
+    s1 %= LMZ_ADLER_BASE;
+    s2 %= LMZ_ADLER_BASE;
+  }
+  return mz_adler32(s1 | (s2 << 16), buf, len);
+}
+
+static void lmz_checksum_detect(void) {
+  unsigned int eax, ebx, ecx, edx;
+  int avx2 = 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return;
+  // AVX2 also needs the OS to save ymm registers (OSXSAVE and XCR0)
+  if ((ecx & (1u << 27)) && (ecx & (1u << 28)) && __get_cpuid_max(0, NULL) >= 7) {
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) == 6) {
+      unsigned int eax7, ebx7, ecx7, edx7;
+      __cpuid_count(7, 0, eax7, ebx7, ecx7, edx7);
+      avx2 = (ebx7 >> 5) & 1;
+    }
+  }
+  if ((ecx & (1u << 1)) && (ecx & (1u << 19))) {
+    lmz_crc32_impl = lmz_crc32_pclmul;
+    lmz_crc32_name = "pclmul";
+  }
+  if (avx2) {
+    lmz_adler32_impl = lmz_adler32_avx2;
+    lmz_adler32_name = "avx2";
+  } else if (ecx & (1u << 9)) {
+    lmz_adler32_impl = lmz_adler32_ssse3;
+    lmz_adler32_name = "ssse3";
+  }
+}
+
+#endif
+
+static void lmz_checksum_init(void) {
+#ifdef LMZ_SIMD_CHECKSUMS
+  const char* env = getenv("LUVI_SIMD_CHECKSUMS");
+  if (env == NULL || strcmp(env, "0") != 0) lmz_checksum_detect();
+#endif
+}
+
+static mz_uint32 lmz_crc32_update(mz_ulong crc, const unsigned char* buf, size_t len) {
+  uv_once(&lmz_checksum_once, lmz_checksum_init);
+  return (mz_uint32)lmz_crc32_impl(crc, buf, len);
+}
+
+static mz_uint32 lmz_adler32_update(mz_ulong adler, const unsigned char* buf, size_t len) {
+  uv_once(&lmz_checksum_once, lmz_checksum_init);
+  return (mz_uint32)lmz_adler32_impl(adler, buf, len);
+}
@@ -18,16 +18,116 @@
 #include "./luvi.h"
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "../deps/miniz/miniz.h"
+#include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "./checksum.c"
+
+// Directory tree of a zip, built the first time a reader is queried by path.
+// Every path (files, explicit directory entries and directories only implied
+// by the names of their children) gets a node, found through an open
+// addressing hash table. Lookups are case-insensitive like miniz's own
+// mz_zip_reader_locate_file.
+typedef struct {
+  mz_uint32 name;     // offset of the normalized path in names
+  mz_uint32 name_len;
+  mz_uint32 base;     // offset of the last path segment within the path
+  int file_index;     // central directory index, -1 for implied directories
+  int is_dir;
+  int first_child;
+  int last_child;
+  int next_sibling;
+} lmz_node_t;
+
+typedef struct {
+  lmz_node_t* nodes;
+  mz_uint32 count;
+  mz_uint32 cap;
+  int* slots;
+  mz_uint32 mask;
+  char* names;
+  size_t names_len;
+  size_t names_cap;
+} lmz_index_t;
 
 typedef struct {
   mz_zip_archive archive;
   uv_loop_t *loop;
   uv_fs_t req;
   uv_file fd;
+  lmz_index_t* index;
+  // Set for readers opened in "mmap" mode: the whole file is mapped and
+  // miniz reads the archive, which starts at map + offset, from memory.
+  const unsigned char* map;
+  size_t map_size;
+  mz_uint64 offset;
+  // Identity of the file a reader was opened on, see lmz_cache_key_t. Only
+  // set (source != 0) when it could be read.
+  struct {
+    int source;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+  } ident;
+  // Buffers reused by extract: read_buf feeds the inflater of file backed
+  // readers, scratch receives entries small enough to keep around.
+  void* read_buf;
+  void* scratch;
+  size_t scratch_size;
+  // Where a writer's archive goes, see lmz_writer_sinks. Callback writers
+  // collect the entry being added in pending, since miniz goes back to fill
+  // in its local header, and hand it to the callback once it is complete.
+  int sink;
+  int sink_ref;
+  int alias_ref;     // table of { index, path, comment } from add_alias
+  char* pending;
+  size_t pending_len;
+  size_t pending_cap;
+  mz_uint64 flushed;
 } lmz_file_t;
 
+enum lmz_writer_sinks {
+  LMZ_SINK_HEAP,     // finalize returns the archive as a string
+  LMZ_SINK_FILE,     // written to fd at offset as entries are added
+  LMZ_SINK_CALLBACK  // passed to a lua function in chunks
+};
+
+// Growable byte buffer that extract_into fills, so servers can reuse one
+// allocation for every large entry instead of creating full-size strings.
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+} lmz_buffer_t;
+
+// Entry opened with reader:open_stream. Keeps a reference to its reader so
+// the archive outlives the stream.
+typedef struct {
+  mz_zip_reader_extract_iter_state* iter;
+  int reader_ref;
+  mz_uint64 size;
+  mz_uint64 done;
+  int verify;      // extracting, so the crc is checked at the end
+  mz_uint32 crc32; // of what was read so far
+} lmz_entry_stream_t;
+
+#define LMZ_STREAM_CHUNK (64 * 1024)
+
+#define LMZ_READ_BUF_SIZE (64 * 1024)
+#define LMZ_SCRATCH_KEEP (256 * 1024)
+
 typedef struct {
   int mode; // 0 = deflate, 1 = inflate
+  int busy; // an async call is using the stream
+  int closed; // the state went back to the pool
+  int level;
+  int window_bits;
   mz_stream stream;
 } lmz_stream_t;
 
@@ -39,6 +139,380 @@ static size_t lmz_file_read(void *pOpaque, mz_uint64 file_ofs, void *pBuf, size_
   return zip->req.result;
 }
 
+// Read callback for mapped files miniz can't read as plain memory (zip64).
+static size_t lmz_map_read(void *pOpaque, mz_uint64 file_ofs, void *pBuf, size_t n) {
+  lmz_file_t* zip = pOpaque;
+  file_ofs += mz_zip_get_archive_file_start_offset(&zip->archive);
+  if (file_ofs >= zip->map_size) return 0;
+  if (n > zip->map_size - file_ofs) n = (size_t)(zip->map_size - file_ofs);
+  memcpy(pBuf, zip->map + file_ofs, n);
+  return n;
+}
+
+static int lmz_file_map(lmz_file_t* zip, mz_uint64 size) {
+  void* map;
+  if (zip->fd < 0 || size == 0 || size > (size_t)-1) return 0;
+#ifdef _WIN32
+  {
+    HANDLE file = (HANDLE)uv_get_osfhandle(zip->fd);
+    HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) return 0;
+    map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    // The view keeps the mapping object alive.
+    CloseHandle(mapping);
+    if (map == NULL) return 0;
+  }
+#else
+  map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, zip->fd, 0);
+  if (map == MAP_FAILED) return 0;
+#endif
+  zip->map = map;
+  zip->map_size = (size_t)size;
+  return 1;
+}
+
+static void lmz_file_unmap(lmz_file_t* zip) {
+  if (zip->map == NULL) return;
+#ifdef _WIN32
+  UnmapViewOfFile(zip->map);
+#else
+  munmap((void*)zip->map, zip->map_size);
+#endif
+  zip->map = NULL;
+  zip->map_size = 0;
+}
+
+#define LMZ_READ_LE16(p) ((mz_uint32)(p)[0] | ((mz_uint32)(p)[1] << 8))
+#define LMZ_READ_LE32(p) (LMZ_READ_LE16(p) | ((mz_uint32)(p)[2] << 16) | ((mz_uint32)(p)[3] << 24))
+
+#define LMZ_READ_LE64(p) ((mz_uint64)LMZ_READ_LE32(p) | ((mz_uint64)LMZ_READ_LE32((p) + 4) << 32))
+
+// buildBundle ends the archive comment with a fixed trailer, so the last bytes
+// of a luvi app say where its zip and central directory are:
+//   0  zip offset (8)        16  central directory size (4)   24  hash (4)
+//   8  central dir offset (8) 20  number of entries (4)        28  version (4)
+//   32 magic (8)
+// Offsets are from the start of the file and the hash is the crc32 of the
+// central directory, which covers the crc of every entry.
+#define LMZ_TRAILER_SIZE 40
+#define LMZ_TRAILER_VERSION 1
+static const char lmz_trailer_magic[8] = {'L', 'U', 'V', 'I', 'Z', 'I', 'P', '\x1a'};
+
+typedef struct {
+  mz_uint64 zip_ofs;
+  mz_uint64 cdir_ofs;
+  mz_uint64 cdir_size;
+  mz_uint64 count;
+  mz_uint32 hash;
+} lmz_trailer_t;
+
+// Zip64 archives put a 56 byte end of central directory record and a 20 byte
+// locator for it between the central directory and the classic record.
+#define LMZ_ZIP64_EOCD_SIZE 56
+#define LMZ_ZIP64_LOCATOR_SIZE 20
+
+// Locate an archive from the end of central directory record that ends tail,
+// followed by a comment of comment_len bytes. tail holds the last len bytes
+// of a file of the given size. Zip64 archives are read from their zip64
+// record, which must directly follow the central directory the way miniz
+// writes it. Fills in everything but the hash.
+static int lmz_eocd_parse(const unsigned char* tail, size_t len, mz_uint64 size, size_t comment_len, lmz_trailer_t* found) {
+  const unsigned char* eocd;
+  const unsigned char* locator;
+  mz_uint64 eocd_pos;
+  if (len < comment_len + 22 || size < len) return 0;
+  eocd = tail + len - comment_len - 22;
+  eocd_pos = size - comment_len - 22;
+  if (LMZ_READ_LE32(eocd) != 0x06054b50 || LMZ_READ_LE16(eocd + 20) != comment_len) return 0;
+  locator = eocd - LMZ_ZIP64_LOCATOR_SIZE;
+  if ((size_t)(eocd - tail) >= LMZ_ZIP64_LOCATOR_SIZE && LMZ_READ_LE32(locator) == 0x07064b50) {
+    const unsigned char* record = locator - LMZ_ZIP64_EOCD_SIZE;
+    mz_uint64 record_pos = eocd_pos - LMZ_ZIP64_LOCATOR_SIZE - LMZ_ZIP64_EOCD_SIZE;
+    mz_uint64 record_ofs = LMZ_READ_LE64(locator + 8);
+    if ((size_t)(eocd - tail) < LMZ_ZIP64_LOCATOR_SIZE + LMZ_ZIP64_EOCD_SIZE ||
+        LMZ_READ_LE32(record) != 0x06064b50 ||
+        LMZ_READ_LE64(record + 4) != LMZ_ZIP64_EOCD_SIZE - 12 || record_ofs > record_pos) {
+      return 0;
+    }
+    found->zip_ofs = record_pos - record_ofs;
+    found->count = LMZ_READ_LE64(record + 32);
+    found->cdir_size = LMZ_READ_LE64(record + 40);
+    found->cdir_ofs = found->zip_ofs + LMZ_READ_LE64(record + 48);
+    return found->cdir_ofs >= found->zip_ofs && found->cdir_ofs + found->cdir_size == record_pos;
+  } else {
+    mz_uint32 cdir_size = LMZ_READ_LE32(eocd + 12);
+    mz_uint32 cdir_ofs = LMZ_READ_LE32(eocd + 16);
+    if (cdir_ofs == 0xffffffff || cdir_size == 0xffffffff) return 0;
+    if ((mz_uint64)cdir_ofs + cdir_size > eocd_pos) return 0;
+    found->cdir_size = cdir_size;
+    found->cdir_ofs = eocd_pos - cdir_size;
+    found->zip_ofs = found->cdir_ofs - cdir_ofs;
+    found->count = LMZ_READ_LE16(eocd + 10);
+    return 1;
+  }
+}
+
+// Parse the trailer at the end of tail, which holds the last len bytes of a
+// file of the given size. It must be the whole comment of the end of central
+// directory record right before it, and agree with that record.
+static int lmz_trailer_parse(const unsigned char* tail, size_t len, mz_uint64 size, lmz_trailer_t* trailer) {
+  const unsigned char* t;
+  lmz_trailer_t found;
+  if (len < LMZ_TRAILER_SIZE + 22 || size < len) return 0;
+  t = tail + len - LMZ_TRAILER_SIZE;
+  if (memcmp(t + 32, lmz_trailer_magic, sizeof(lmz_trailer_magic)) != 0 ||
+      LMZ_READ_LE32(t + 28) != LMZ_TRAILER_VERSION ||
+      !lmz_eocd_parse(tail, len, size, LMZ_TRAILER_SIZE, &found)) {
+    return 0;
+  }
+  trailer->zip_ofs = LMZ_READ_LE64(t);
+  trailer->cdir_ofs = LMZ_READ_LE64(t + 8);
+  trailer->cdir_size = LMZ_READ_LE32(t + 16);
+  trailer->count = LMZ_READ_LE32(t + 20);
+  trailer->hash = LMZ_READ_LE32(t + 24);
+  return trailer->zip_ofs == found.zip_ofs && trailer->cdir_ofs == found.cdir_ofs &&
+    trailer->cdir_size == found.cdir_size && trailer->count == found.count;
+}
+
+// Find where an archive starts inside a mapped file from its end of central
+// directory record, the same way miniz does for zips appended to other data.
+// Returns 0 when there is no usable record.
+static int lmz_map_find_start(const unsigned char* map, size_t size, mz_uint64* start) {
+  size_t pos, stop;
+  lmz_trailer_t found;
+  if (lmz_trailer_parse(map, size, size, &found)) {
+    *start = found.zip_ofs;
+    return 1;
+  }
+  if (size < 22) return 0;
+  // The record is 22 bytes followed by a comment of up to 64KB.
+  stop = size > 22 + 0xffff ? size - 22 - 0xffff : 0;
+  pos = size - 22;
+  for (;;) {
+    if (LMZ_READ_LE32(map + pos) == 0x06054b50) {
+      if (!lmz_eocd_parse(map, size, size, size - 22 - pos, &found)) return 0;
+      *start = found.zip_ofs;
+      return 1;
+    }
+    if (pos == stop) return 0;
+    pos--;
+  }
+}
+
+// Pointer to the data of a stored entry inside the mapping, or NULL.
+static const unsigned char* lmz_map_entry_data(lmz_file_t* zip, const mz_zip_archive_file_stat* stat) {
+  mz_uint64 base = zip->offset + mz_zip_get_archive_file_start_offset(&zip->archive);
+  mz_uint64 ofs = base + stat->m_local_header_ofs;
+  const unsigned char* p;
+  if (zip->map == NULL || ofs + 30 > zip->map_size) return NULL;
+  p = zip->map + ofs;
+  if (LMZ_READ_LE32(p) != 0x04034b50) return NULL;
+  ofs += 30 + LMZ_READ_LE16(p + 26) + LMZ_READ_LE16(p + 28);
+  if (ofs + stat->m_comp_size > zip->map_size) return NULL;
+  return zip->map + ofs;
+}
+
+#ifdef _WIN32
+#define LMZ_IS_SEP(c) ((c) == '/' || (c) == '\\')
+#else
+#define LMZ_IS_SEP(c) ((c) == '/')
+#endif
+
+// Normalize a bundle path the way pathJoin("./" .. path) does: separators
+// are collapsed, "." segments dropped and ".." removes the previous segment.
+// The result has no leading or trailing slash. `out` must hold `len` bytes.
+static size_t lmz_normalize_path(const char* path, size_t len, char* out) {
+  size_t i = 0, o = 0;
+  while (i < len) {
+    size_t start, seg;
+    while (i < len && LMZ_IS_SEP(path[i])) i++;
+    start = i;
+    while (i < len && !LMZ_IS_SEP(path[i])) i++;
+    seg = i - start;
+    if (seg == 0 || (seg == 1 && path[start] == '.')) continue;
+    if (seg == 2 && path[start] == '.' && path[start + 1] == '.') {
+      while (o > 0 && out[o - 1] != '/') o--;
+      if (o > 0) o--;
+      continue;
+    }
+    if (o > 0) out[o++] = '/';
+    memcpy(out + o, path + start, seg);
+    o += seg;
+  }
+  return o;
+}
+
+static mz_uint32 lmz_hash_path(const char* path, size_t len) {
+  mz_uint32 hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)path[i];
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    hash = (hash ^ c) * 16777619u;
+  }
+  return hash;
+}
+
+static int lmz_path_equal(const char* a, const char* b, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    unsigned char ca = (unsigned char)a[i], cb = (unsigned char)b[i];
+    if (ca >= 'A' && ca <= 'Z') ca += 'a' - 'A';
+    if (cb >= 'A' && cb <= 'Z') cb += 'a' - 'A';
+    if (ca != cb) return 0;
+  }
+  return 1;
+}
+
+static void lmz_index_free(lmz_index_t* index) {
+  if (index == NULL) return;
+  free(index->nodes);
+  free(index->slots);
+  free(index->names);
+  free(index);
+}
+
+static int lmz_index_find(const lmz_index_t* index, const char* path, size_t len) {
+  mz_uint32 slot = lmz_hash_path(path, len) & index->mask;
+  for (;;) {
+    int n = index->slots[slot];
+    const lmz_node_t* node;
+    if (n < 0) return -1;
+    node = &index->nodes[n];
+    if (node->name_len == len &&
+        lmz_path_equal(index->names + node->name, path, len)) {
+      return n;
+    }
+    slot = (slot + 1) & index->mask;
+  }
+}
+
+static int lmz_index_grow(lmz_index_t* index) {
+  mz_uint32 i, cap = index->cap ? index->cap * 2 : 64;
+  lmz_node_t* nodes = realloc(index->nodes, cap * sizeof(*nodes));
+  int* slots;
+  if (nodes == NULL) return 0;
+  index->nodes = nodes;
+  // Keep the table at most half full so probe sequences stay short.
+  slots = malloc(cap * 2 * sizeof(*slots));
+  if (slots == NULL) return 0;
+  free(index->slots);
+  index->slots = slots;
+  index->cap = cap;
+  index->mask = cap * 2 - 1;
+  for (i = 0; i <= index->mask; i++) slots[i] = -1;
+  for (i = 0; i < index->count; i++) {
+    lmz_node_t* node = &nodes[i];
+    mz_uint32 slot = lmz_hash_path(index->names + node->name, node->name_len) & index->mask;
+    while (slots[slot] >= 0) slot = (slot + 1) & index->mask;
+    slots[slot] = i;
+  }
+  return 1;
+}
+
+// Find or create the node for the first `len` bytes of the name stored at
+// `name`, creating implied parent directories as needed.
+static int lmz_index_insert(lmz_index_t* index, mz_uint32 name, size_t len) {
+  const char* path = index->names + name;
+  int parent = 0, n;
+  size_t base = len;
+  mz_uint32 slot;
+  lmz_node_t* node;
+  n = lmz_index_find(index, path, len);
+  if (n >= 0) return n;
+  while (base > 0 && path[base - 1] != '/') base--;
+  if (base > 0) {
+    parent = lmz_index_insert(index, name, base - 1);
+    if (parent < 0) return -1;
+    index->nodes[parent].is_dir = 1;
+  }
+  if (index->count == index->cap && !lmz_index_grow(index)) return -1;
+  n = index->count++;
+  node = &index->nodes[n];
+  node->name = name;
+  node->name_len = (mz_uint32)len;
+  node->base = (mz_uint32)base;
+  node->file_index = -1;
+  node->is_dir = 0;
+  node->first_child = -1;
+  node->last_child = -1;
+  node->next_sibling = -1;
+  slot = lmz_hash_path(path, len) & index->mask;
+  while (index->slots[slot] >= 0) slot = (slot + 1) & index->mask;
+  index->slots[slot] = n;
+  if (n > 0) {
+    lmz_node_t* p = &index->nodes[parent];
+    if (p->last_child >= 0) index->nodes[p->last_child].next_sibling = n;
+    else p->first_child = n;
+    p->last_child = n;
+  }
+  return n;
+}
+
+static lmz_index_t* lmz_index_build(mz_zip_archive* archive) {
+  lmz_index_t* index = calloc(1, sizeof(*index));
+  mz_uint i, num_files = mz_zip_reader_get_num_files(archive);
+  char filename[PATH_MAX];
+  if (index == NULL) return NULL;
+  if (!lmz_index_grow(index)) goto fail;
+  // The root directory is always node 0.
+  if (lmz_index_insert(index, 0, 0) != 0) goto fail;
+  index->nodes[0].is_dir = 1;
+  for (i = 0; i < num_files; i++) {
+    mz_uint filename_len = mz_zip_reader_get_filename(archive, i, filename, sizeof(filename));
+    size_t len;
+    mz_uint32 name;
+    int n;
+    if (filename_len == 0) continue;
+    if (index->names_len + filename_len > index->names_cap) {
+      size_t cap = index->names_cap ? index->names_cap * 2 : 4096;
+      char* names;
+      while (cap < index->names_len + filename_len) cap *= 2;
+      names = realloc(index->names, cap);
+      if (names == NULL) goto fail;
+      index->names = names;
+      index->names_cap = cap;
+    }
+    name = (mz_uint32)index->names_len;
+    len = lmz_normalize_path(filename, filename_len - 1, index->names + name);
+    if (len == 0) continue;
+    index->names_len += len;
+    n = lmz_index_insert(index, name, len);
+    if (n < 0) goto fail;
+    // Keep the first entry when a zip has duplicate names.
+    if (index->nodes[n].file_index < 0) {
+      index->nodes[n].file_index = i;
+      if (mz_zip_reader_is_file_a_directory(archive, i)) {
+        index->nodes[n].is_dir = 1;
+      }
+    }
+  }
+  return index;
+fail:
+  lmz_index_free(index);
+  return NULL;
+}
+
+// Look up a bundle path in the reader's index, building it on first use.
+// Returns the node or NULL if the path does not exist.
+static const lmz_node_t* lmz_reader_lookup(lua_State* L, lmz_file_t* zip, int arg) {
+  size_t len;
+  const char* path = luaL_checklstring(L, arg, &len);
+  char normalized[PATH_MAX];
+  int n;
+  if (zip->index == NULL) {
+    zip->index = lmz_index_build(&(zip->archive));
+    if (zip->index == NULL) {
+      luaL_error(L, "Problem building zip index");
+      return NULL;
+    }
+  }
+  if (len >= sizeof(normalized)) return NULL;
+  len = lmz_normalize_path(path, len, normalized);
+  n = lmz_index_find(zip->index, normalized, len);
+  return n < 0 ? NULL : &zip->index->nodes[n];
+}
+
 static int lmz_check_compression_level(lua_State* L, int index) {
   int level = luaL_optinteger(L, index, MZ_DEFAULT_COMPRESSION);
   if (level < MZ_DEFAULT_COMPRESSION || level > MZ_BEST_COMPRESSION) {
@@ -47,22 +521,61 @@ static int lmz_check_compression_level(lua_State* L, int index) {
   return level;
 }
 
+static const char* reader_modes[] = {
+  "read", "mmap",
+  NULL
+};
+
 static int lmz_reader_init(lua_State* L) {
   const char* path = luaL_checkstring(L, 1);
   mz_uint32 flags = luaL_optinteger(L, 2, 0);
+  int mode = luaL_checkoption(L, 3, "read", reader_modes);
   mz_uint64 size;
+  mz_bool ok;
   lmz_file_t* zip = lua_newuserdata(L, sizeof(*zip));
   mz_zip_archive* archive = &(zip->archive);
   luaL_getmetatable(L, "miniz_reader");
   lua_setmetatable(L, -2);
   memset(archive, 0, sizeof(*archive));
+  zip->index = NULL;
+  zip->map = NULL;
+  zip->map_size = 0;
+  zip->offset = 0;
+  zip->read_buf = NULL;
+  zip->scratch = NULL;
+  zip->scratch_size = 0;
+  zip->sink = LMZ_SINK_HEAP;
+  zip->sink_ref = LUA_NOREF;
+  zip->alias_ref = LUA_NOREF;
+  zip->pending = NULL;
+  zip->pending_len = zip->pending_cap = 0;
+  zip->flushed = 0;
   zip->loop = luv_loop(L);
   zip->fd = uv_fs_open(zip->loop, &(zip->req), path, O_RDONLY, 0644, NULL);
-  uv_fs_fstat(zip->loop, &(zip->req), zip->fd, NULL);
+  memset(&zip->ident, 0, sizeof(zip->ident));
+  if (uv_fs_fstat(zip->loop, &(zip->req), zip->fd, NULL) == 0) {
+    zip->ident.source = 1;
+    zip->ident.dev = zip->req.statbuf.st_dev;
+    zip->ident.ino = zip->req.statbuf.st_ino;
+    zip->ident.size = zip->req.statbuf.st_size;
+    zip->ident.mtime_sec = zip->req.statbuf.st_mtim.tv_sec;
+    zip->ident.mtime_nsec = zip->req.statbuf.st_mtim.tv_nsec;
+  }
   size = zip->req.statbuf.st_size;
-  archive->m_pRead = lmz_file_read;
-  archive->m_pIO_opaque = zip;
-  if (!mz_zip_reader_init(archive, size, flags)) {
+  if (mode == 1 && lmz_file_map(zip, size)) {
+    if (lmz_map_find_start(zip->map, zip->map_size, &(zip->offset))) {
+      ok = mz_zip_reader_init_mem(archive, zip->map + zip->offset, (size_t)(size - zip->offset), flags);
+    } else {
+      archive->m_pRead = lmz_map_read;
+      archive->m_pIO_opaque = zip;
+      ok = mz_zip_reader_init(archive, size, flags);
+    }
+  } else {
+    archive->m_pRead = lmz_file_read;
+    archive->m_pIO_opaque = zip;
+    ok = mz_zip_reader_init(archive, size, flags);
+  }
+  if (!ok) {
     lua_pushnil(L);
     lua_pushfstring(L, "read %s fail because of %s", path,
       mz_zip_get_error_string(mz_zip_get_last_error(archive)));
@@ -73,15 +586,28 @@ static int lmz_reader_init(lua_State* L) {
 
 static int lmz_reader_gc(lua_State *L) {
   lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
+  lmz_index_free(zip->index);
+  zip->index = NULL;
+  mz_zip_reader_end(&(zip->archive));
+  lmz_file_unmap(zip);
+  free(zip->read_buf);
+  zip->read_buf = NULL;
+  free(zip->scratch);
+  zip->scratch = NULL;
   uv_fs_close(zip->loop, &(zip->req), zip->fd, NULL);
   uv_fs_req_cleanup(&(zip->req));
-  mz_zip_reader_end(&(zip->archive));
   return 0;
 }
 
 static int lmz_writer_gc(lua_State *L) {
   lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_writer");
   mz_zip_writer_end(&(zip->archive));
+  free(zip->pending);
+  zip->pending = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, zip->sink_ref);
+  zip->sink_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, zip->alias_ref);
+  zip->alias_ref = LUA_NOREF;
   return 0;
 }
 
@@ -105,6 +631,71 @@ static int lmz_reader_locate_file(lua_State *L) {
   return 1;
 }
 
+// Like locate_file, but resolves the path the way bundles do and finds
+// directories with or without a trailing slash.
+static int lmz_reader_locate(lua_State *L) {
+  lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
+  const lmz_node_t* node = lmz_reader_lookup(L, zip, 2);
+  if (node == NULL || node->file_index < 0) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "Can't find file %s.", lua_tostring(L, 2));
+    return 2;
+  }
+  lua_pushinteger(L, node->file_index + 1);
+  return 1;
+}
+
+// Bundle style stat by path: { type, size, mtime }
+static int lmz_reader_stat_path(lua_State *L) {
+  lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
+  const lmz_node_t* node = lmz_reader_lookup(L, zip, 2);
+  mz_zip_archive_file_stat stat;
+  mz_uint64 size = 0;
+  lua_Integer mtime = 0;
+  if (node == NULL) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "Can't find file %s.", lua_tostring(L, 2));
+    return 2;
+  }
+  if (node->file_index >= 0 &&
+      mz_zip_reader_file_stat(&(zip->archive), node->file_index, &stat)) {
+    size = stat.m_uncomp_size;
+    mtime = stat.m_time;
+  }
+  lua_createtable(L, 0, 3);
+  lua_pushstring(L, node->is_dir ? "directory" : "file");
+  lua_setfield(L, -2, "type");
+  lua_pushinteger(L, size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, mtime);
+  lua_setfield(L, -2, "mtime");
+  return 1;
+}
+
+// List the names of the direct children of a directory.
+static int lmz_reader_readdir(lua_State *L) {
+  lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
+  const lmz_node_t* node = lmz_reader_lookup(L, zip, 2);
+  int child, i = 0;
+  if (node == NULL) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "Can't find file %s.", lua_tostring(L, 2));
+    return 2;
+  }
+  if (!node->is_dir) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s is not a directory", lua_tostring(L, 2));
+    return 2;
+  }
+  lua_newtable(L);
+  for (child = node->first_child; child >= 0; child = zip->index->nodes[child].next_sibling) {
+    const lmz_node_t* c = &zip->index->nodes[child];
+    lua_pushlstring(L, zip->index->names + c->name + c->base, c->name_len - c->base);
+    lua_rawseti(L, -2, ++i);
+  }
+  return 1;
+}
+
 static int lmz_reader_stat(lua_State* L) {
   lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
   mz_uint file_index = (mz_uint)luaL_checkinteger(L, 2) - 1;
@@ -165,14 +756,417 @@ static int lmz_reader_is_file_a_directory(lua_State  *L) {
   return 1;
 }
 
+// Size of what extracting an entry with flags produces.
+static int lmz_reader_entry_size(lua_State* L, lmz_file_t* zip, mz_uint file_index, mz_uint flags, mz_zip_archive_file_stat* stat, size_t* size) {
+  mz_uint64 n;
+  if (!mz_zip_reader_file_stat(&(zip->archive), file_index, stat)) {
+    lua_pushnil(L);
+    lua_pushstring(L, mz_zip_get_error_string(mz_zip_get_last_error(&(zip->archive))));
+    return 0;
+  }
+  n = (flags & MZ_ZIP_FLAG_COMPRESSED_DATA) ? stat->m_comp_size : stat->m_uncomp_size;
+  if (n > (size_t)-1) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s is too large to extract", stat->m_filename);
+    return 0;
+  }
+  *size = (size_t)n;
+  return 1;
+}
+
+// Bytes of an entry as extracted with flags, when they can be read straight
+// from the mapping: stored entries and raw compressed data of mapped archives.
+// Returns 1 with *data set, 0 when the entry has to go through miniz, or -1
+// with nil and an error pushed.
+static int lmz_reader_mapped(lua_State* L, lmz_file_t* zip, mz_uint flags, const mz_zip_archive_file_stat* stat, size_t size, const unsigned char** data) {
+  if (zip->map == NULL || stat->m_is_encrypted ||
+      (stat->m_method != 0 && !(flags & MZ_ZIP_FLAG_COMPRESSED_DATA))) {
+    return 0;
+  }
+  *data = lmz_map_entry_data(zip, stat);
+  if (*data == NULL) return 0;
+  if (!(flags & MZ_ZIP_FLAG_COMPRESSED_DATA) &&
+      lmz_crc32_update(MZ_CRC32_INIT, *data, size) != stat->m_crc32) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s failed the crc check", stat->m_filename);
+    return -1;
+  }
+  return 1;
+}
+
+// Extract an entry into out, which holds exactly size bytes. Stored entries of
+// mapped archives are copied straight from the mapping, everything else is
+// inflated in place by miniz without any intermediate allocation.
+static int lmz_reader_extract_to(lua_State* L, lmz_file_t* zip, mz_uint file_index, mz_uint flags, const mz_zip_archive_file_stat* stat, void* out, size_t size) {
+  const unsigned char* data;
+  switch (lmz_reader_mapped(L, zip, flags, stat, size, &data)) {
+    case 1:
+      memcpy(out, data, size);
+      return 1;
+    case -1:
+      return 0;
+  }
+  // Memory backed archives (mmap mode) are inflated directly from memory,
+  // the others need a read buffer, which is kept for the next call.
+  if ((zip->archive.m_pRead == lmz_file_read || zip->archive.m_pRead == lmz_map_read) &&
+      zip->read_buf == NULL) {
+    zip->read_buf = malloc(LMZ_READ_BUF_SIZE);
+  }
+  if (!mz_zip_reader_extract_to_mem_no_alloc(&(zip->archive), file_index, out, size, flags,
+                                             zip->read_buf, zip->read_buf ? LMZ_READ_BUF_SIZE : 0)) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "extract %s fail because of %s", stat->m_filename,
+      mz_zip_get_error_string(mz_zip_get_last_error(&(zip->archive))));
+    return 0;
+  }
+  // miniz is built without its own (scalar) crc checks, see checksum.c
+  if (!(flags & MZ_ZIP_FLAG_COMPRESSED_DATA) &&
+      lmz_crc32_update(MZ_CRC32_INIT, out, size) != stat->m_crc32) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s failed the crc check", stat->m_filename);
+    return 0;
+  }
+  return 1;
+}
+
+// Process wide cache of inflated entries, shared by all readers and lua
+// states. Entries are keyed by where they are stored: the file (device,
+// inode, size and mtime when it was opened) and the offset of the entry's
+// local header, with the crc32 and sizes on top. Keying by content alone
+// would let any zip the process opens plant data for an entry of another one
+// with the same (easily forged) crc. Deduplicated aliases share their local
+// header, so they are still inflated once as long as they stay within the
+// budget (LUVI_ZIP_CACHE bytes, off by default). Oldest entries are evicted
+// first.
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t file_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  mz_uint64 offset;   // of the local header in the file
+  mz_uint32 crc32;
+  mz_uint64 size;
+  mz_uint64 comp_size;
+} lmz_cache_key_t;
+
+typedef struct lmz_cache_entry_s {
+  struct lmz_cache_entry_s* next;   // hash chain
+  struct lmz_cache_entry_s* newer;  // insertion order
+  lmz_cache_key_t key;
+  char data[1];
+} lmz_cache_entry_t;
+
+#define LMZ_CACHE_BUCKETS 1024
+
+static struct {
+  uv_mutex_t lock;
+  lmz_cache_entry_t* buckets[LMZ_CACHE_BUCKETS];
+  lmz_cache_entry_t* oldest;
+  lmz_cache_entry_t* newest;
+  size_t bytes;
+  size_t limit;
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+} lmz_cache;
+static uv_once_t lmz_cache_once = UV_ONCE_INIT;
+
+static void lmz_cache_init(void) {
+  const char* limit = getenv("LUVI_ZIP_CACHE");
+  uv_mutex_init(&lmz_cache.lock);
+  lmz_cache.limit = limit ? (size_t)strtoull(limit, NULL, 10) : 0;
+}
+
+static void lmz_cache_make_key(lmz_file_t* zip, const mz_zip_archive_file_stat* stat, lmz_cache_key_t* key) {
+  memset(key, 0, sizeof(*key));
+  key->dev = zip->ident.dev;
+  key->ino = zip->ident.ino;
+  key->file_size = zip->ident.size;
+  key->mtime_sec = zip->ident.mtime_sec;
+  key->mtime_nsec = zip->ident.mtime_nsec;
+  key->offset = zip->offset + mz_zip_get_archive_file_start_offset(&zip->archive) +
+    stat->m_local_header_ofs;
+  key->crc32 = stat->m_crc32;
+  key->size = stat->m_uncomp_size;
+  key->comp_size = stat->m_comp_size;
+}
+
+static lmz_cache_entry_t** lmz_cache_slot(const lmz_cache_key_t* key) {
+  mz_uint32 hash = key->crc32 ^ (mz_uint32)key->offset ^ (mz_uint32)key->ino;
+  lmz_cache_entry_t** slot = &lmz_cache.buckets[hash % LMZ_CACHE_BUCKETS];
+  while (*slot && memcmp(&(*slot)->key, key, sizeof(*key)) != 0) {
+    slot = &(*slot)->next;
+  }
+  return slot;
+}
+
+// Evict the oldest entries until bytes fit. Called with the lock held.
+static void lmz_cache_trim(size_t limit) {
+  while (lmz_cache.oldest && lmz_cache.bytes > limit) {
+    lmz_cache_entry_t* entry = lmz_cache.oldest;
+    lmz_cache_entry_t** slot = lmz_cache_slot(&entry->key);
+    *slot = entry->next;
+    lmz_cache.oldest = entry->newer;
+    if (lmz_cache.oldest == NULL) lmz_cache.newest = NULL;
+    lmz_cache.bytes -= (size_t)entry->key.size;
+    lmz_cache.evictions++;
+    free(entry);
+  }
+}
+
+static int lmz_cache_wanted(lmz_file_t* zip, const mz_zip_archive_file_stat* stat, mz_uint flags) {
+  size_t limit;
+  uv_once(&lmz_cache_once, lmz_cache_init);
+  // Stored entries cost a copy at most, not worth the memory.
+  if (!zip->ident.source || stat->m_method == 0 || (flags & MZ_ZIP_FLAG_COMPRESSED_DATA)) return 0;
+  // miniz.extract_cache may change the limit from any thread
+  uv_mutex_lock(&lmz_cache.lock);
+  limit = lmz_cache.limit;
+  uv_mutex_unlock(&lmz_cache.lock);
+  return stat->m_uncomp_size <= limit / 8;
+}
+
+static int lmz_cache_get(const lmz_cache_key_t* key, void* out) {
+  lmz_cache_entry_t* entry;
+  uv_mutex_lock(&lmz_cache.lock);
+  entry = *lmz_cache_slot(key);
+  if (entry) {
+    memcpy(out, entry->data, (size_t)entry->key.size);
+    lmz_cache.hits++;
+  } else {
+    lmz_cache.misses++;
+  }
+  uv_mutex_unlock(&lmz_cache.lock);
+  return entry != NULL;
+}
+
+static void lmz_cache_put(const lmz_cache_key_t* key, const void* data) {
+  lmz_cache_entry_t* entry = malloc(sizeof(*entry) + (size_t)key->size);
+  lmz_cache_entry_t** slot;
+  if (entry == NULL) return;
+  entry->next = entry->newer = NULL;
+  memcpy(&entry->key, key, sizeof(*key));
+  memcpy(entry->data, data, (size_t)key->size);
+  uv_mutex_lock(&lmz_cache.lock);
+  slot = lmz_cache_slot(key);
+  if (*slot == NULL) {
+    *slot = entry;
+    if (lmz_cache.newest) lmz_cache.newest->newer = entry;
+    else lmz_cache.oldest = entry;
+    lmz_cache.newest = entry;
+    lmz_cache.bytes += (size_t)key->size;
+    entry = NULL;
+    lmz_cache_trim(lmz_cache.limit);
+  }
+  uv_mutex_unlock(&lmz_cache.lock);
+  // Another thread got there first
+  free(entry);
+}
+
+// miniz.extract_cache([limit]) returns the cache counters, after changing
+// its budget when limit is given.
+static int lmz_extract_cache(lua_State* L) {
+  uv_once(&lmz_cache_once, lmz_cache_init);
+  uv_mutex_lock(&lmz_cache.lock);
+  if (!lua_isnoneornil(L, 1)) {
+    lua_Integer limit = luaL_checkinteger(L, 1);
+    lmz_cache.limit = limit > 0 ? (size_t)limit : 0;
+    lmz_cache_trim(lmz_cache.limit);
+  }
+  lua_createtable(L, 0, 5);
+  lua_pushinteger(L, lmz_cache.limit);
+  lua_setfield(L, -2, "limit");
+  lua_pushinteger(L, lmz_cache.bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushinteger(L, lmz_cache.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, lmz_cache.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, lmz_cache.evictions);
+  lua_setfield(L, -2, "evictions");
+  uv_mutex_unlock(&lmz_cache.lock);
+  return 1;
+}
+
 static int lmz_reader_extract(lua_State *L) {
   lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
   mz_uint file_index = (mz_uint)luaL_checkinteger(L, 2) - 1;
   mz_uint flags = luaL_optinteger(L, 3, 0);
-  size_t out_len;
-  char* out_buf = mz_zip_reader_extract_to_heap(&(zip->archive), file_index, &out_len, flags);
-  lua_pushlstring(L, out_buf, out_len);
-  free(out_buf);
+  mz_zip_archive_file_stat stat;
+  const unsigned char* data;
+  size_t size;
+  void* out;
+  int ok;
+  if (!lmz_reader_entry_size(L, zip, file_index, flags, &stat, &size)) return 2;
+  if (size == 0) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  // Stored entries of mapped archives are copied once, from the mapping into
+  // the lua string.
+  switch (lmz_reader_mapped(L, zip, flags, &stat, size, &data)) {
+    case 1:
+      lua_pushlstring(L, (const char*)data, size);
+      return 1;
+    case -1:
+      return 2;
+  }
+  // Small entries are extracted into the reader's scratch space, large ones
+  // into a single userdata of exactly their size, which the gc reclaims even
+  // when pushing the result raises.
+  if (size <= LMZ_SCRATCH_KEEP) {
+    if (zip->scratch_size < size) {
+      void* scratch = realloc(zip->scratch, LMZ_SCRATCH_KEEP);
+      if (scratch == NULL) return luaL_error(L, "out of memory");
+      zip->scratch = scratch;
+      zip->scratch_size = LMZ_SCRATCH_KEEP;
+    }
+    out = zip->scratch;
+  } else {
+    out = lua_newuserdata(L, size);
+  }
+  if (lmz_cache_wanted(zip, &stat, flags)) {
+    lmz_cache_key_t key;
+    lmz_cache_make_key(zip, &stat, &key);
+    ok = lmz_cache_get(&key, out);
+    if (!ok) {
+      ok = lmz_reader_extract_to(L, zip, file_index, flags, &stat, out, size);
+      // lmz_reader_extract_to has checked the crc against the entry.
+      if (ok) lmz_cache_put(&key, out);
+    }
+  } else {
+    ok = lmz_reader_extract_to(L, zip, file_index, flags, &stat, out, size);
+  }
+  if (!ok) return 2;
+  lua_pushlstring(L, out, size);
+  return 1;
+}
+
+// Absolute offset of an entry's data in the reader's file, found from its
+// local header. Returns 0 if the header can't be read.
+static int lmz_reader_data_offset(lmz_file_t* zip, const mz_zip_archive_file_stat* stat, mz_uint64* offset) {
+  unsigned char header[30];
+  mz_uint64 ofs = stat->m_local_header_ofs;
+  if (mz_zip_read_archive_data(&(zip->archive), ofs, header, sizeof(header)) != sizeof(header) ||
+      LMZ_READ_LE32(header) != 0x04034b50) {
+    return 0;
+  }
+  ofs += sizeof(header) + LMZ_READ_LE16(header + 26) + LMZ_READ_LE16(header + 28);
+  *offset = zip->offset + mz_zip_get_archive_file_start_offset(&(zip->archive)) + ofs;
+  return 1;
+}
+
+// reader:raw(index [, with_data]) describes an entry as it is stored: method
+// (0 stored, 8 deflate), crc32, size, comp_size and the offset/length of its
+// bytes in the file, ready for uv.fs_sendfile. Unless with_data is false,
+// data holds those bytes, which for deflated entries is a raw deflate stream
+// that can be served as is.
+static int lmz_reader_raw(lua_State *L) {
+  lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
+  mz_uint file_index = (mz_uint)luaL_checkinteger(L, 2) - 1;
+  int with_data = lua_isnoneornil(L, 3) || lua_toboolean(L, 3);
+  mz_zip_archive_file_stat stat;
+  mz_uint64 offset;
+  size_t size;
+  if (!lmz_reader_entry_size(L, zip, file_index, MZ_ZIP_FLAG_COMPRESSED_DATA, &stat, &size)) return 2;
+  if (stat.m_is_encrypted || (stat.m_method != 0 && stat.m_method != MZ_DEFLATED)) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s uses an unsupported method or encryption", stat.m_filename);
+    return 2;
+  }
+  if (!lmz_reader_data_offset(zip, &stat, &offset)) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s has an invalid local header", stat.m_filename);
+    return 2;
+  }
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, stat.m_method);
+  lua_setfield(L, -2, "method");
+  lua_pushinteger(L, stat.m_crc32);
+  lua_setfield(L, -2, "crc32");
+  lua_pushinteger(L, stat.m_uncomp_size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, stat.m_comp_size);
+  lua_setfield(L, -2, "comp_size");
+  lua_pushinteger(L, offset);
+  lua_setfield(L, -2, "offset");
+  lua_pushinteger(L, size);
+  lua_setfield(L, -2, "length");
+  if (with_data) {
+    if (zip->map && offset + size <= zip->map_size) {
+      lua_pushlstring(L, (const char*)zip->map + offset, size);
+    } else {
+      // A userdata, so nothing leaks when pushing the string runs out of memory
+      char* data = lua_newuserdata(L, size ? size : 1);
+      if (!lmz_reader_extract_to(L, zip, file_index, MZ_ZIP_FLAG_COMPRESSED_DATA, &stat, data, size)) {
+        return 2;
+      }
+      lua_pushlstring(L, data, size);
+      lua_remove(L, -2);
+    }
+    lua_setfield(L, -2, "data");
+  }
+  return 1;
+}
+
+// reader:prefetch(offset, length) asks the OS to read a range of the file
+// (absolute offsets, like raw's) ahead of use, e.g. the entries a startup
+// manifest put at the front. Returns whether the hint could be given.
+static int lmz_reader_prefetch(lua_State *L) {
+  lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
+  lua_Integer offset = luaL_checkinteger(L, 2);
+  lua_Integer length = luaL_checkinteger(L, 3);
+  int ok = 0;
+  if (offset < 0 || length <= 0) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+#ifndef _WIN32
+  if (zip->map) {
+    // madvise wants a page aligned start
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)offset / page * page;
+    size_t end = (size_t)(offset + length);
+    if (end > zip->map_size) end = zip->map_size;
+    if (start < end) {
+      ok = madvise((void*)(zip->map + start), end - start, MADV_WILLNEED) == 0;
+    }
+  }
+#if defined(POSIX_FADV_WILLNEED)
+  else {
+    ok = posix_fadvise(zip->fd, (off_t)offset, (off_t)length, POSIX_FADV_WILLNEED) == 0;
+  }
+#endif
+#else
+  (void)zip;
+#endif
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+// Extract an entry into a miniz buffer, growing it when needed. Returns the
+// number of bytes extracted.
+static int lmz_reader_extract_into(lua_State *L) {
+  lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
+  mz_uint file_index = (mz_uint)luaL_checkinteger(L, 2) - 1;
+  lmz_buffer_t* buffer = luaL_checkudata(L, 3, "miniz_buffer");
+  mz_uint flags = luaL_optinteger(L, 4, 0);
+  mz_zip_archive_file_stat stat;
+  size_t size;
+  if (!lmz_reader_entry_size(L, zip, file_index, flags, &stat, &size)) return 2;
+  if (buffer->cap < size) {
+    char* data = realloc(buffer->data, size);
+    if (data == NULL) return luaL_error(L, "out of memory");
+    buffer->data = data;
+    buffer->cap = size;
+  }
+  buffer->len = 0;
+  if (size > 0 && !lmz_reader_extract_to(L, zip, file_index, flags, &stat, buffer->data, size)) {
+    return 2;
+  }
+  buffer->len = size;
+  lua_pushinteger(L, size);
   return 1;
 }
 
@@ -180,25 +1174,116 @@ static int lmz_reader_get_offset(lua_State *L) {
   lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
   mz_zip_archive* archive = &(zip->archive);
 
-  lua_pushinteger(L, mz_zip_get_archive_file_start_offset(archive));
+  lua_pushinteger(L, zip->offset + mz_zip_get_archive_file_start_offset(archive));
   return 1;
 }
 
-static int lmz_writer_init(lua_State *L) {
-  size_t size_to_reserve_at_beginning = luaL_optinteger(L, 1, 0);
-  size_t initial_allocation_size = luaL_optinteger(L, 2, 128 * 1024);
+static lmz_file_t* lmz_writer_new(lua_State *L, int sink) {
   lmz_file_t* zip = lua_newuserdata(L, sizeof(*zip));
-  mz_zip_archive* archive = &(zip->archive);
+  memset(zip, 0, sizeof(*zip));
   luaL_getmetatable(L, "miniz_writer");
   lua_setmetatable(L, -2);
-  memset(archive, 0, sizeof(*archive));
+  zip->fd = -1;
+  zip->sink = sink;
+  zip->sink_ref = LUA_NOREF;
+  zip->alias_ref = LUA_NOREF;
   zip->loop = luv_loop(L);
-  if (!mz_zip_writer_init_heap(archive, size_to_reserve_at_beginning, initial_allocation_size)) {
+  return zip;
+}
+
+static int lmz_writer_init(lua_State *L) {
+  size_t size_to_reserve_at_beginning = luaL_optinteger(L, 1, 0);
+  size_t initial_allocation_size = luaL_optinteger(L, 2, 128 * 1024);
+  lmz_file_t* zip = lmz_writer_new(L, LMZ_SINK_HEAP);
+  if (!mz_zip_writer_init_heap(&(zip->archive), size_to_reserve_at_beginning, initial_allocation_size)) {
     return luaL_error(L, "Problem initializing heap writer");
   }
   return 1;
 }
 
+static size_t lmz_file_write(void *pOpaque, mz_uint64 file_ofs, const void *pBuf, size_t n) {
+  lmz_file_t* zip = pOpaque;
+  size_t done = 0;
+  while (done < n) {
+    const uv_buf_t buf = uv_buf_init((char*)pBuf + done, n - done);
+    uv_fs_write(zip->loop, &(zip->req), zip->fd, &buf, 1, zip->offset + file_ofs + done, NULL);
+    if (zip->req.result <= 0) break;
+    done += zip->req.result;
+  }
+  return done;
+}
+
+static size_t lmz_pending_write(void *pOpaque, mz_uint64 file_ofs, const void *pBuf, size_t n) {
+  lmz_file_t* zip = pOpaque;
+  size_t start, end;
+  // Flushed data can't be changed any more
+  if (file_ofs < zip->flushed) return 0;
+  start = (size_t)(file_ofs - zip->flushed);
+  end = start + n;
+  if (end > zip->pending_cap) {
+    size_t cap = zip->pending_cap ? zip->pending_cap * 2 : 64 * 1024;
+    char* pending;
+    while (cap < end) cap *= 2;
+    pending = realloc(zip->pending, cap);
+    if (pending == NULL) return 0;
+    zip->pending = pending;
+    zip->pending_cap = cap;
+  }
+  if (start > zip->pending_len) memset(zip->pending + zip->pending_len, 0, start - zip->pending_len);
+  memcpy(zip->pending + start, pBuf, n);
+  if (end > zip->pending_len) zip->pending_len = end;
+  return n;
+}
+
+// Hand everything written so far to a callback writer's function. Called
+// after each miniz call, when no part of the data is rewritten any more.
+static void lmz_writer_flush(lua_State *L, lmz_file_t* zip) {
+  if (zip->sink != LMZ_SINK_CALLBACK || zip->pending_len == 0) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, zip->sink_ref);
+  lua_pushlstring(L, zip->pending, zip->pending_len);
+  zip->flushed += zip->pending_len;
+  zip->pending_len = 0;
+  // Don't hold on to the buffer of an unusually large entry
+  if (zip->pending_cap > 1024 * 1024) {
+    free(zip->pending);
+    zip->pending = NULL;
+    zip->pending_cap = 0;
+  }
+  lua_call(L, 1, 0);
+}
+
+// miniz.new_file_writer(fd [, offset]) writes the archive to fd, starting at
+// offset, as entries are added instead of building it in memory.
+static int lmz_file_writer_init(lua_State *L) {
+  uv_file fd = (uv_file)luaL_checkinteger(L, 1);
+  mz_uint64 offset = luaL_optinteger(L, 2, 0);
+  lmz_file_t* zip = lmz_writer_new(L, LMZ_SINK_FILE);
+  zip->fd = fd;
+  zip->offset = offset;
+  zip->archive.m_pWrite = lmz_file_write;
+  zip->archive.m_pIO_opaque = zip;
+  if (!mz_zip_writer_init(&(zip->archive), 0)) {
+    return luaL_error(L, "Problem initializing file writer");
+  }
+  return 1;
+}
+
+// miniz.new_callback_writer(fn) calls fn with each chunk of the archive as
+// soon as it is final, which is once per added entry and on finalize.
+static int lmz_callback_writer_init(lua_State *L) {
+  lmz_file_t* zip;
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  zip = lmz_writer_new(L, LMZ_SINK_CALLBACK);
+  lua_pushvalue(L, 1);
+  zip->sink_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  zip->archive.m_pWrite = lmz_pending_write;
+  zip->archive.m_pIO_opaque = zip;
+  if (!mz_zip_writer_init(&(zip->archive), 0)) {
+    return luaL_error(L, "Problem initializing callback writer");
+  }
+  return 1;
+}
+
 static int lmz_writer_add_from_zip_reader(lua_State *L) {
   lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_writer");
   lmz_file_t* source = luaL_checkudata(L, 2, "miniz_reader");
@@ -206,6 +1291,7 @@ static int lmz_writer_add_from_zip_reader(lua_State *L) {
   if (!mz_zip_writer_add_from_zip_reader(&(zip->archive), &(source->archive), file_index)) {
     return luaL_error(L, "Failure to copy file between zips");
   }
+  lmz_writer_flush(L, zip);
   return 0;
 }
 
@@ -218,46 +1304,522 @@ static int lmz_writer_add_mem(lua_State *L) {
   if (!mz_zip_writer_add_mem(&(zip->archive), path, data, size, flags)) {
     return luaL_error(L, "Failure to add entry to zip");
   }
+  lmz_writer_flush(L, zip);
   return 0;
 }
-static int lmz_writer_finalize(lua_State *L) {
+
+// writer:add_raw(path, data, method, crc32, size [, mtime [, comment]])
+// appends an entry prepared by miniz.zip_compress. Stored entries (method 0)
+// are added as is, deflated ones are copied without recompressing. mtime
+// (seconds since the epoch, default now) makes the output reproducible.
+static int lmz_writer_add_raw(lua_State *L) {
   lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_writer");
-  void* data;
+  const char* path = luaL_checkstring(L, 2);
   size_t size;
+  const char* data = luaL_checklstring(L, 3, &size);
+  int method = luaL_checkinteger(L, 4);
+  mz_uint32 crc32 = (mz_uint32)luaL_optinteger(L, 5, 0);
+  mz_uint64 uncomp_size = luaL_optinteger(L, 6, 0);
+  time_t mtime = lua_isnoneornil(L, 7) ? time(NULL) : (time_t)luaL_checkinteger(L, 7);
+  size_t comment_size;
+  const char* comment = luaL_optlstring(L, 8, NULL, &comment_size);
+  mz_uint flags;
+  if (comment && comment_size > 0xffff) {
+    return luaL_argerror(L, 8, "comment is too long");
+  }
+  if (method == 0) {
+    // miniz computes the crc of stored entries itself
+    flags = 0;
+    crc32 = 0;
+    uncomp_size = 0;
+  } else if (method == MZ_DEFLATED) {
+    flags = MZ_ZIP_FLAG_COMPRESSED_DATA | MZ_DEFAULT_LEVEL;
+  } else {
+    return luaL_argerror(L, 4, "method must be 0 (stored) or 8 (deflate)");
+  }
+  if (!mz_zip_writer_add_mem_ex_v2(&(zip->archive), path, data, size,
+                                   comment, comment ? (mz_uint16)comment_size : 0, flags,
+                                   uncomp_size, crc32, &mtime, NULL, 0, NULL, 0)) {
+    return luaL_error(L, "Failure to add entry to zip");
+  }
+  lmz_writer_flush(L, zip);
+  return 0;
+}
+
+// writer:add_alias(path, index [, comment]) adds an entry named path that
+// shares the data of the index-th entry already written, for deduplicating
+// identical files. Aliases get their central directory records on finalize.
+static int lmz_writer_add_alias(lua_State *L) {
+  lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_writer");
+  size_t len;
+  luaL_checklstring(L, 2, &len);
+  lua_Integer index = luaL_checkinteger(L, 3);
+  luaL_optstring(L, 4, NULL);
+  if (index < 1 || index > (lua_Integer)zip->archive.m_total_files) {
+    return luaL_argerror(L, 3, "not the index of a written entry");
+  }
+  if (len == 0 || len > 0xffff) return luaL_argerror(L, 2, "invalid entry name");
+  if (zip->alias_ref == LUA_NOREF) {
+    lua_newtable(L);
+    zip->alias_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, zip->alias_ref);
+  lua_createtable(L, 3, 0);
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, 1);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, 2);
+  if (!lua_isnoneornil(L, 4)) {
+    lua_pushvalue(L, 4);
+    lua_rawseti(L, -2, 3);
+  }
+  lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+  lua_pop(L, 1);
+  return 0;
+}
+
+// Push the central directory cdir (count records) followed by records for
+// the writer's aliases and an updated copy of the end of central directory
+// record eocd. Aliases copy their target's record, so they point at the same
+// local header, with their own name and comment. Scratch memory lives in
+// userdata, as any of the pushes may raise.
+static void lmz_writer_push_aliased(lua_State *L, lmz_file_t* zip, const unsigned char* cdir,
+                                    size_t cdir_size, mz_uint32 count, const unsigned char* eocd) {
+  const unsigned char** records;
+  const unsigned char* p = cdir;
+  size_t size = cdir_size;
+  unsigned char end[22];
+  int aliases, i, n;
+  luaL_Buffer buf;
+  records = lua_newuserdata(L, sizeof(*records) * (count ? count : 1));
+  for (i = 0; i < (int)count; i++) {
+    if (p + 46 > cdir + cdir_size || LMZ_READ_LE32(p) != 0x02014b50) {
+      luaL_error(L, "Problem reading back the central directory");
+    }
+    records[i] = p;
+    p += 46 + LMZ_READ_LE16(p + 28) + LMZ_READ_LE16(p + 30) + LMZ_READ_LE16(p + 32);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, zip->alias_ref);
+  aliases = lua_gettop(L);
+  n = (int)lua_rawlen(L, aliases);
+  luaL_buffinit(L, &buf);
+  luaL_addlstring(&buf, (const char*)cdir, cdir_size);
+  for (i = 1; i <= n; i++) {
+    const unsigned char* target;
+    unsigned char header[46];
+    size_t name_len, comment_len = 0, extra_len;
+    const char* name;
+    const char* comment = NULL;
+    // The strings stay referenced by the alias table, so they can be popped
+    // to keep the stack balanced for the buffer.
+    lua_rawgeti(L, aliases, i);
+    lua_rawgeti(L, -1, 1);
+    target = records[lua_tointeger(L, -1) - 1];
+    lua_rawgeti(L, -2, 2);
+    name = lua_tolstring(L, -1, &name_len);
+    lua_rawgeti(L, -3, 3);
+    if (lua_isstring(L, -1)) comment = lua_tolstring(L, -1, &comment_len);
+    lua_pop(L, 4);
+    if (comment_len > 0xffff) comment_len = 0xffff;
+    extra_len = LMZ_READ_LE16(target + 30);
+    memcpy(header, target, sizeof(header));
+    header[28] = (unsigned char)name_len;
+    header[29] = (unsigned char)(name_len >> 8);
+    header[32] = (unsigned char)comment_len;
+    header[33] = (unsigned char)(comment_len >> 8);
+    luaL_addlstring(&buf, (const char*)header, sizeof(header));
+    luaL_addlstring(&buf, name, name_len);
+    luaL_addlstring(&buf, (const char*)target + 46 + LMZ_READ_LE16(target + 28), extra_len);
+    if (comment) luaL_addlstring(&buf, comment, comment_len);
+    size += sizeof(header) + name_len + extra_len + comment_len;
+  }
+  memcpy(end, eocd, sizeof(end));
+  count += n;
+  end[8] = end[10] = (unsigned char)count;
+  end[9] = end[11] = (unsigned char)(count >> 8);
+  end[12] = (unsigned char)size;
+  end[13] = (unsigned char)(size >> 8);
+  end[14] = (unsigned char)(size >> 16);
+  end[15] = (unsigned char)(size >> 24);
+  end[20] = end[21] = 0;
+  luaL_addlstring(&buf, (const char*)end, sizeof(end));
+  luaL_pushresult(&buf);
+  lua_replace(L, aliases - 1);
+  lua_pop(L, 1);
+  if (count > 0xffff || size > 0xffffffff) {
+    luaL_error(L, "Too many aliases for a zip without zip64 support");
+  }
+}
+
+// Check the end of central directory record miniz wrote and find the central
+// directory. Aliases aren't supported in zip64 archives.
+static void lmz_writer_read_eocd(lua_State *L, const unsigned char* eocd, mz_uint32* count,
+                                 size_t* cdir_size, mz_uint64* cdir_ofs) {
+  if (LMZ_READ_LE32(eocd) != 0x06054b50) {
+    luaL_error(L, "Problem reading back the end of central directory");
+  }
+  *count = LMZ_READ_LE16(eocd + 10);
+  *cdir_size = LMZ_READ_LE32(eocd + 12);
+  *cdir_ofs = LMZ_READ_LE32(eocd + 16);
+  if (*count == 0xffff || *cdir_size == 0xffffffff || *cdir_ofs == 0xffffffff) {
+    luaL_error(L, "Aliases are not supported in zip64 archives");
+  }
+}
+
+// Rewrite the tail of a finalized archive to include the aliases. Returns the
+// new archive size; heap writers leave the whole archive on the stack.
+static mz_uint64 lmz_writer_finish_aliases(lua_State *L, lmz_file_t* zip, const unsigned char* data, size_t size) {
+  mz_uint32 count;
+  size_t cdir_size, tail_len;
+  mz_uint64 cdir_ofs;
+  const char* tail;
+  if (zip->sink == LMZ_SINK_HEAP) {
+    lmz_writer_read_eocd(L, data + size - 22, &count, &cdir_size, &cdir_ofs);
+    lua_pushlstring(L, (const char*)data, (size_t)cdir_ofs);
+    lmz_writer_push_aliased(L, zip, data + cdir_ofs, cdir_size, count, data + size - 22);
+    tail_len = lua_rawlen(L, -1);
+    lua_concat(L, 2);
+    return cdir_ofs + tail_len;
+  }
+  if (zip->sink == LMZ_SINK_CALLBACK) {
+    lmz_writer_read_eocd(L, (const unsigned char*)zip->pending + zip->pending_len - 22,
+                         &count, &cdir_size, &cdir_ofs);
+    if (cdir_ofs != zip->flushed || cdir_size + 22 != zip->pending_len) {
+      luaL_error(L, "Problem reading back the central directory");
+    }
+    lmz_writer_push_aliased(L, zip, (const unsigned char*)zip->pending, cdir_size, count,
+                            (const unsigned char*)zip->pending + cdir_size);
+    tail = lua_tolstring(L, -1, &tail_len);
+    zip->pending_len = 0;
+    if (lmz_pending_write(zip, cdir_ofs, tail, tail_len) != tail_len) {
+      luaL_error(L, "out of memory");
+    }
+    lua_pop(L, 1);
+    return cdir_ofs + tail_len;
+  } else {
+    unsigned char eocd[22];
+    char* cdir;
+    uv_buf_t buf = uv_buf_init((char*)eocd, sizeof(eocd));
+    uv_fs_read(zip->loop, &(zip->req), zip->fd, &buf, 1, zip->offset + zip->archive.m_archive_size - 22, NULL);
+    if (zip->req.result != sizeof(eocd)) luaL_error(L, "Problem reading back the end of central directory");
+    lmz_writer_read_eocd(L, eocd, &count, &cdir_size, &cdir_ofs);
+    cdir = lua_newuserdata(L, cdir_size ? cdir_size : 1);
+    buf = uv_buf_init(cdir, (unsigned int)cdir_size);
+    uv_fs_read(zip->loop, &(zip->req), zip->fd, &buf, 1, zip->offset + cdir_ofs, NULL);
+    if (zip->req.result != (ssize_t)cdir_size) {
+      luaL_error(L, "Problem reading back the central directory");
+    }
+    lmz_writer_push_aliased(L, zip, (const unsigned char*)cdir, cdir_size, count, eocd);
+    lua_remove(L, -2);
+    tail = lua_tolstring(L, -1, &tail_len);
+    if (lmz_file_write(zip, cdir_ofs, tail, tail_len) != tail_len) {
+      luaL_error(L, "Problem writing the central directory");
+    }
+    lua_pop(L, 1);
+    return cdir_ofs + tail_len;
+  }
+}
+
+// Heap writers return the archive, the others its size once it's all out.
+static int lmz_writer_finalize(lua_State *L) {
+  lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_writer");
+  void* data;
+  size_t size;
+  if (zip->sink != LMZ_SINK_HEAP) {
+    mz_uint64 archive_size;
+    if (!mz_zip_writer_finalize_archive(&(zip->archive))) {
+      return luaL_error(L, "Problem finalizing archive");
+    }
+    archive_size = zip->archive.m_archive_size;
+    if (zip->alias_ref != LUA_NOREF) {
+      archive_size = lmz_writer_finish_aliases(L, zip, NULL, 0);
+    }
+    lmz_writer_flush(L, zip);
+    lua_pushinteger(L, archive_size);
+    return 1;
+  }
   if (!mz_zip_writer_finalize_heap_archive(&(zip->archive), &data, &size)) {
     luaL_error(L, "Problem finalizing archive");
   }
-  lua_pushlstring(L, data, size);
+  if (zip->alias_ref != LUA_NOREF) {
+    lmz_writer_finish_aliases(L, zip, data, size);
+  } else {
+    lua_pushlstring(L, data, size);
+  }
   return 1;
 }
 
-static int lmz_deflator_init(lua_State* L) {
-  int level = lmz_check_compression_level(L, 1);
-  lmz_stream_t* stream = lua_newuserdata(L, sizeof(*stream));
-  mz_streamp miniz_stream = &(stream->stream);
-  luaL_getmetatable(L, "miniz_deflator");
-  lua_setmetatable(L, -2);
-  memset(miniz_stream, 0, sizeof(*miniz_stream));
-  int status = mz_deflateInit(miniz_stream, level);
-  if (status != MZ_OK) {
-    const char* msg = mz_error(status);
-    if (msg) {
-      luaL_error(L, "Problem initializing stream: %s", msg);
-    } else {
-      luaL_error(L, "Problem initializing stream");
-    }
+static void lmz_write_le32(unsigned char* p, mz_uint32 v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+static void lmz_write_le64(unsigned char* p, mz_uint64 v) {
+  lmz_write_le32(p, (mz_uint32)v);
+  lmz_write_le32(p + 4, (mz_uint32)(v >> 32));
+}
+
+static void lmz_push_trailer(lua_State* L, const lmz_trailer_t* trailer, int has_hash) {
+  lua_createtable(L, 0, 5);
+  lua_pushinteger(L, trailer->zip_ofs);
+  lua_setfield(L, -2, "offset");
+  lua_pushinteger(L, trailer->cdir_ofs);
+  lua_setfield(L, -2, "cdir_offset");
+  lua_pushinteger(L, trailer->cdir_size);
+  lua_setfield(L, -2, "cdir_size");
+  lua_pushinteger(L, trailer->count);
+  lua_setfield(L, -2, "files");
+  if (has_hash) {
+    lua_pushinteger(L, trailer->hash);
+    lua_setfield(L, -2, "hash");
   }
-  stream->mode = 0;
+}
+
+// miniz.probe(path) checks for a zip at the end of path with one small read
+// of its last bytes, instead of scanning for it like new_reader. Returns a
+// table with offset, cdir_offset, cdir_size and files (plus the hash for apps
+// built with a trailer), or nil when path doesn't end with a zip. Zips with
+// their own archive comment are only found by new_reader.
+static int lmz_probe(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  uv_loop_t* loop = luv_loop(L);
+  unsigned char tail[LMZ_ZIP64_EOCD_SIZE + LMZ_ZIP64_LOCATOR_SIZE + 22 + LMZ_TRAILER_SIZE];
+  lmz_trailer_t trailer;
+  mz_uint64 size = 0;
+  size_t len;
+  uv_fs_t req;
+  uv_buf_t buf;
+  uv_file fd = uv_fs_open(loop, &req, path, O_RDONLY, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, uv_strerror(fd));
+    return 2;
+  }
+  if (uv_fs_fstat(loop, &req, fd, NULL) == 0) size = req.statbuf.st_size;
+  uv_fs_req_cleanup(&req);
+  len = size < sizeof(tail) ? (size_t)size : sizeof(tail);
+  buf = uv_buf_init((char*)tail, (unsigned int)len);
+  uv_fs_read(loop, &req, fd, &buf, 1, size - len, NULL);
+  if (req.result != (ssize_t)len) len = 0;
+  uv_fs_req_cleanup(&req);
+  uv_fs_close(loop, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  if (lmz_trailer_parse(tail, len, size, &trailer)) {
+    lmz_push_trailer(L, &trailer, 1);
+    return 1;
+  }
+  // A zip appended by hand, without an archive comment
+  if (lmz_eocd_parse(tail, len, size, 0, &trailer)) {
+    lmz_push_trailer(L, &trailer, 0);
+    return 1;
+  }
+  lua_pushnil(L);
   return 1;
 }
 
-static int lmz_inflator_init(lua_State* L) {
+// miniz.append_trailer(fd, offset, size) ends the size byte zip written at
+// offset in fd with the trailer probe looks for, as its archive comment.
+// Returns the new size of the zip and its hash.
+static int lmz_append_trailer(lua_State* L) {
+  uv_file fd = (uv_file)luaL_checkinteger(L, 1);
+  mz_uint64 offset = luaL_checkinteger(L, 2);
+  mz_uint64 size = luaL_checkinteger(L, 3);
+  uv_loop_t* loop = luv_loop(L);
+  unsigned char tail[LMZ_ZIP64_EOCD_SIZE + LMZ_ZIP64_LOCATOR_SIZE + 22 + LMZ_TRAILER_SIZE];
+  unsigned char* eocd;
+  unsigned char* t;
+  size_t len = LMZ_ZIP64_EOCD_SIZE + LMZ_ZIP64_LOCATOR_SIZE + 22;
+  lmz_trailer_t found;
+  mz_uint32 hash;
+  char* cdir;
+  uv_fs_t req;
+  uv_buf_t buf;
+  ssize_t result;
+  if (size < 22) return luaL_error(L, "Not a zip archive");
+  if (len > size) len = (size_t)size;
+  buf = uv_buf_init((char*)tail, (unsigned int)len);
+  uv_fs_read(loop, &req, fd, &buf, 1, offset + size - len, NULL);
+  result = req.result;
+  uv_fs_req_cleanup(&req);
+  // Offsets come out relative to the zip, which starts at 0 here
+  if (result != (ssize_t)len || !lmz_eocd_parse(tail, len, size, 0, &found)) {
+    return luaL_error(L, "Problem reading back the end of central directory");
+  }
+  if (found.cdir_size > 0xffffffff || found.count > 0xffffffff) {
+    return luaL_error(L, "Central directory too large for a trailer");
+  }
+  cdir = malloc(found.cdir_size ? (size_t)found.cdir_size : 1);
+  if (cdir == NULL) return luaL_error(L, "out of memory");
+  buf = uv_buf_init(cdir, (unsigned int)found.cdir_size);
+  uv_fs_read(loop, &req, fd, &buf, 1, offset + found.cdir_ofs, NULL);
+  result = req.result;
+  uv_fs_req_cleanup(&req);
+  if (result != (ssize_t)found.cdir_size) {
+    free(cdir);
+    return luaL_error(L, "Problem reading back the central directory");
+  }
+  hash = lmz_crc32_update(MZ_CRC32_INIT, (const unsigned char*)cdir, (size_t)found.cdir_size);
+  free(cdir);
+  eocd = tail + len - 22;
+  t = eocd + 22;
+  eocd[20] = LMZ_TRAILER_SIZE;
+  eocd[21] = 0;
+  lmz_write_le64(t, offset + found.zip_ofs);
+  lmz_write_le64(t + 8, offset + found.cdir_ofs);
+  lmz_write_le32(t + 16, (mz_uint32)found.cdir_size);
+  lmz_write_le32(t + 20, (mz_uint32)found.count);
+  lmz_write_le32(t + 24, hash);
+  lmz_write_le32(t + 28, LMZ_TRAILER_VERSION);
+  memcpy(t + 32, lmz_trailer_magic, sizeof(lmz_trailer_magic));
+  buf = uv_buf_init((char*)eocd, 22 + LMZ_TRAILER_SIZE);
+  uv_fs_write(loop, &req, fd, &buf, 1, offset + size - 22, NULL);
+  result = req.result;
+  uv_fs_req_cleanup(&req);
+  if (result != 22 + LMZ_TRAILER_SIZE) {
+    return luaL_error(L, "Problem writing the trailer");
+  }
+  lua_pushinteger(L, size + LMZ_TRAILER_SIZE);
+  lua_pushinteger(L, hash);
+  return 2;
+}
+
+// Deflate and inflate states are big (a tdefl compressor is over 300KB), so
+// instead of ending them when a stream is closed or collected they go to a
+// pool of the lua state, by mode, level and window bits, and the next stream
+// with the same settings takes one from there already reset. Each kind keeps
+// up to `limit` idle states.
+
+#define LMZ_POOL_KEY "miniz.pool"
+#define LMZ_POOL_LIMIT 4
+// 12 levels (-1 to 10) and zlib or raw for deflate, then zlib or raw inflate
+#define LMZ_POOL_KINDS (12 * 2 + 2)
+
+typedef struct lmz_pooled_s {
+  struct lmz_pooled_s* next;
+  mz_stream stream;
+} lmz_pooled_t;
+
+typedef struct {
+  lmz_pooled_t* idle[LMZ_POOL_KINDS];
+  int counts[LMZ_POOL_KINDS];
+  int limit;
+  int closed;
+  size_t hits;
+  size_t misses;
+  size_t returns;
+  size_t drops;
+} lmz_pool_t;
+
+static int lmz_pool_kind(int mode, int level, int window_bits) {
+  if (mode) return 12 * 2 + (window_bits < 0);
+  return (level + 1) * 2 + (window_bits < 0);
+}
+
+static void lmz_stream_end(int mode, mz_streamp stream) {
+  if (mode) {
+    mz_inflateEnd(stream);
+  } else {
+    mz_deflateEnd(stream);
+  }
+}
+
+static int lmz_pool_gc(lua_State* L) {
+  lmz_pool_t* pool = lua_touserdata(L, 1);
+  int kind;
+  for (kind = 0; kind < LMZ_POOL_KINDS; kind++) {
+    while (pool->idle[kind]) {
+      lmz_pooled_t* pooled = pool->idle[kind];
+      pool->idle[kind] = pooled->next;
+      lmz_stream_end(kind >= 12 * 2, &pooled->stream);
+      free(pooled);
+    }
+    pool->counts[kind] = 0;
+  }
+  // Streams collected after the pool while the state closes end their own
+  pool->closed = 1;
+  return 0;
+}
+
+static lmz_pool_t* lmz_pool_get(lua_State* L) {
+  lmz_pool_t* pool;
+  lua_getfield(L, LUA_REGISTRYINDEX, LMZ_POOL_KEY);
+  pool = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (pool == NULL) {
+    pool = lua_newuserdata(L, sizeof(*pool));
+    memset(pool, 0, sizeof(*pool));
+    pool->limit = LMZ_POOL_LIMIT;
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, lmz_pool_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, LMZ_POOL_KEY);
+  }
+  return pool;
+}
+
+static void lmz_pool_trim(lmz_pool_t* pool, int kind) {
+  while (pool->counts[kind] > pool->limit) {
+    lmz_pooled_t* pooled = pool->idle[kind];
+    pool->idle[kind] = pooled->next;
+    pool->counts[kind]--;
+    pool->drops++;
+    lmz_stream_end(kind >= 12 * 2, &pooled->stream);
+    free(pooled);
+  }
+}
+
+// Move a stream's state to the pool, or end it when the pool is full.
+static void lmz_pool_put(lua_State* L, lmz_stream_t* stream) {
+  lmz_pool_t* pool;
+  lmz_pooled_t* pooled;
+  int kind = lmz_pool_kind(stream->mode, stream->level, stream->window_bits);
+  if (stream->closed) return;
+  stream->closed = 1;
+  pool = lmz_pool_get(L);
+  if (pool->closed || pool->counts[kind] >= pool->limit ||
+      (pooled = malloc(sizeof(*pooled))) == NULL ||
+      (stream->mode ? mz_inflateReset(&stream->stream) : mz_deflateReset(&stream->stream)) != MZ_OK) {
+    if (!pool->closed) pool->drops++;
+    lmz_stream_end(stream->mode, &stream->stream);
+    return;
+  }
+  pooled->stream = stream->stream;
+  pooled->next = pool->idle[kind];
+  pool->idle[kind] = pooled;
+  pool->counts[kind]++;
+  pool->returns++;
+}
+
+static lmz_stream_t* lmz_stream_new(lua_State* L, int mode, int level, int window_bits) {
+  lmz_pool_t* pool = lmz_pool_get(L);
+  int kind = lmz_pool_kind(mode, level, window_bits);
   lmz_stream_t* stream = lua_newuserdata(L, sizeof(*stream));
   mz_streamp miniz_stream = &(stream->stream);
-  luaL_getmetatable(L, "miniz_inflator");
+  int status;
+  memset(stream, 0, sizeof(*stream));
+  stream->closed = 1; // nothing to end until the state is set up
+  luaL_getmetatable(L, mode ? "miniz_inflator" : "miniz_deflator");
   lua_setmetatable(L, -2);
-  memset(miniz_stream, 0, sizeof(*miniz_stream));
-  int status = mz_inflateInit(miniz_stream);
+  if (pool->idle[kind]) {
+    lmz_pooled_t* pooled = pool->idle[kind];
+    pool->idle[kind] = pooled->next;
+    pool->counts[kind]--;
+    pool->hits++;
+    stream->stream = pooled->stream;
+    free(pooled);
+    status = MZ_OK;
+  } else {
+    pool->misses++;
+    if (mode) {
+      status = mz_inflateInit2(miniz_stream, window_bits);
+    } else {
+      status = mz_deflateInit2(miniz_stream, level, MZ_DEFLATED, window_bits, 9, MZ_DEFAULT_STRATEGY);
+    }
+  }
   if (status != MZ_OK) {
     const char* msg = mz_error(status);
     if (msg) {
@@ -266,71 +1828,238 @@ static int lmz_inflator_init(lua_State* L) {
       luaL_error(L, "Problem initializing stream");
     }
   }
-  stream->mode = 1;
+  stream->mode = mode;
+  stream->level = level;
+  stream->window_bits = window_bits;
+  stream->closed = 0;
+  return stream;
+}
+
+// miniz only does 32KB windows, with (positive) or without (negative) the
+// zlib header and checksum.
+static int lmz_check_window_bits(lua_State* L, int index) {
+  int window_bits = luaL_optinteger(L, index, MZ_DEFAULT_WINDOW_BITS);
+  if (window_bits != MZ_DEFAULT_WINDOW_BITS && window_bits != -MZ_DEFAULT_WINDOW_BITS) {
+    luaL_error(L, "Window bits must be %d or %d", MZ_DEFAULT_WINDOW_BITS, -MZ_DEFAULT_WINDOW_BITS);
+  }
+  return window_bits;
+}
+
+// miniz.new_deflator([level [, window_bits]])
+static int lmz_deflator_init(lua_State* L) {
+  int level = lmz_check_compression_level(L, 1);
+  int window_bits = lmz_check_window_bits(L, 2);
+  lmz_stream_new(L, 0, level, window_bits);
+  return 1;
+}
+
+// miniz.new_inflator([window_bits])
+static int lmz_inflator_init(lua_State* L) {
+  int window_bits = lmz_check_window_bits(L, 1);
+  lmz_stream_new(L, 1, 0, window_bits);
   return 1;
 }
 
 static int lmz_deflator_gc(lua_State* L) {
   lmz_stream_t* stream = luaL_checkudata(L, 1, "miniz_deflator");
-  mz_deflateEnd(&(stream->stream));
+  lmz_pool_put(L, stream);
   return 0;
 }
 
 static int lmz_inflator_gc(lua_State* L) {
   lmz_stream_t* stream = luaL_checkudata(L, 1, "miniz_inflator");
-  mz_inflateEnd(&(stream->stream));
+  lmz_pool_put(L, stream);
   return 0;
 }
 
+// miniz.stream_pool([limit]) returns the pool counters of this lua state,
+// after changing how many idle states of each kind it keeps.
+static int lmz_stream_pool(lua_State* L) {
+  lmz_pool_t* pool = lmz_pool_get(L);
+  int kind, idle = 0;
+  if (!lua_isnoneornil(L, 1)) {
+    lua_Integer limit = luaL_checkinteger(L, 1);
+    pool->limit = limit > 0 ? (int)(limit < INT_MAX ? limit : INT_MAX) : 0;
+    for (kind = 0; kind < LMZ_POOL_KINDS; kind++) {
+      lmz_pool_trim(pool, kind);
+    }
+  }
+  for (kind = 0; kind < LMZ_POOL_KINDS; kind++) {
+    idle += pool->counts[kind];
+  }
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, pool->limit);
+  lua_setfield(L, -2, "limit");
+  lua_pushinteger(L, idle);
+  lua_setfield(L, -2, "idle");
+  lua_pushinteger(L, pool->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, pool->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, pool->returns);
+  lua_setfield(L, -2, "returns");
+  lua_pushinteger(L, pool->drops);
+  lua_setfield(L, -2, "drops");
+  return 1;
+}
+
 static const char* flush_types[] = {
   "no", "partial", "sync", "full", "finish", "block",
   NULL
 };
 
+// Make room for cap bytes in a buffer, keeping what's in it.
+static int lmz_buffer_reserve(lmz_buffer_t* buffer, size_t cap) {
+  char* data;
+  if (buffer->cap >= cap) return 1;
+  data = realloc(buffer->data, cap);
+  if (data == NULL) return 0;
+  buffer->data = data;
+  buffer->cap = cap;
+  return 1;
+}
+
+// Run a deflate or inflate stream over all of in, appending the output to out.
+// Each call into miniz gets all the room left in out, which doubles when it
+// runs out, so a buffer of the right size takes a single call.
+static int lmz_stream_run(mz_streamp stream, int mode, const unsigned char* in, size_t in_len,
+                          int flush, lmz_buffer_t* out, int* ended) {
+  stream->next_in = in;
+  stream->avail_in = (unsigned int)in_len;
+  // miniz only inflates with MZ_FINISH when all the output fits at once,
+  // a sync flush inflates as much without that limit.
+  if (mode && flush == MZ_FINISH) flush = MZ_SYNC_FLUSH;
+  for (;;) {
+    mz_ulong before = stream->total_out;
+    size_t room;
+    int status;
+    if (out->len == out->cap && !lmz_buffer_reserve(out, out->cap < 2048 ? 4096 : out->cap * 2)) {
+      return MZ_MEM_ERROR;
+    }
+    room = out->cap - out->len;
+    stream->next_out = (unsigned char*)out->data + out->len;
+    stream->avail_out = room > UINT_MAX ? UINT_MAX : (unsigned int)room;
+    status = mode ? mz_inflate(stream, flush) : mz_deflate(stream, flush);
+    out->len += stream->total_out - before;
+    if (status == MZ_STREAM_END) {
+      if (ended) *ended = 1;
+      return MZ_OK;
+    }
+    if (status == MZ_BUF_ERROR) return MZ_OK;
+    if (status != MZ_OK) return status;
+    // Inflate can stop with room left and output still pending, so it goes on
+    // until a call adds nothing.
+    if (stream->avail_out != 0 && (!mode || stream->total_out == before)) return MZ_OK;
+  }
+}
+
+// Where output starts without a hint: deflate's bound for the input, or a few
+// times the input for inflate.
+static size_t lmz_stream_out_hint(lmz_stream_t* stream, size_t in_len) {
+  if (stream->mode) return in_len < 1024 ? 4096 : in_len * 4;
+  return mz_deflateBound(&stream->stream, (mz_ulong)in_len) + 64;
+}
+
+// stream:deflate(data [, flush [, out]]) and stream:inflate(...). out is
+// either the expected size of the output, which is then allocated once, or
+// a miniz buffer the output goes into (replacing its contents), in which case
+// the number of bytes written is returned instead of a string.
 static int lmz_inflator_deflator_impl(lua_State* L, lmz_stream_t* stream) {
-  mz_streamp miniz_stream = &(stream->stream);
   size_t data_size;
   const char* data = luaL_checklstring(L, 2, &data_size);
   int flush = luaL_checkoption(L, 3, "no", flush_types);
-  miniz_stream->avail_in = data_size;
-  miniz_stream->next_in = (const unsigned char*)data;
-  luaL_Buffer buf;
-  luaL_buffinit(L, &buf);
-  do {
-    miniz_stream->avail_out = LUAL_BUFFERSIZE;
-    miniz_stream->next_out = (unsigned char*)luaL_prepbuffer(&buf);
-    int status;
-    size_t before = miniz_stream->total_out;
-    if (stream->mode) {
-      status = mz_inflate(miniz_stream, flush);
+  lmz_buffer_t* target = NULL;
+  lmz_buffer_t local = { NULL, 0, 0 };
+  lmz_buffer_t* out = &local;
+  size_t hint;
+  int status;
+  if (lua_isuserdata(L, 4)) {
+    target = luaL_checkudata(L, 4, "miniz_buffer");
+    out = target;
+    out->len = 0;
+  }
+  if (lua_isnoneornil(L, 4) || target) {
+    hint = lmz_stream_out_hint(stream, data_size);
+  } else {
+    lua_Integer size = luaL_checkinteger(L, 4);
+    luaL_argcheck(L, size >= 0, 4, "output size must not be negative");
+    hint = size > 0 ? (size_t)size : 1;
+  }
+  if (!lmz_buffer_reserve(out, hint)) return luaL_error(L, "out of memory");
+  status = lmz_stream_run(&stream->stream, stream->mode, (const unsigned char*)data, data_size,
+                          flush, out, NULL);
+  if (status != MZ_OK) {
+    const char* msg = mz_error(status);
+    lua_pushnil(L);
+    lua_pushstring(L, msg ? msg : "Problem processing data");
+    if (target) {
+      lua_pushinteger(L, target->len);
     } else {
-      status = mz_deflate(miniz_stream, flush);
-    }
-    size_t added = miniz_stream->total_out - before;
-    switch (status) {
-      case MZ_OK:
-      case MZ_STREAM_END:
-        luaL_addsize(&buf, added);
-        break;
-      case MZ_BUF_ERROR:
-        break;
-      default:
-        lua_pushnil(L);
-        lua_pushstring(L, mz_error(status));
-        luaL_pushresult(&buf);
-        return 3;
+      lua_pushlstring(L, local.data, local.len);
+      free(local.data);
     }
-  } while (miniz_stream->avail_out == 0);
-  luaL_pushresult(&buf);
+    return 3;
+  }
+  if (target) {
+    lua_pushinteger(L, target->len);
+  } else {
+    lua_pushlstring(L, local.data, local.len);
+    free(local.data);
+  }
   return 1;
 }
 
+static lmz_stream_t* lmz_check_stream(lua_State* L, const char* type) {
+  lmz_stream_t* stream = luaL_checkudata(L, 1, type);
+  if (stream->closed) luaL_error(L, "Stream is closed");
+  if (stream->busy) luaL_error(L, "Stream is busy with an async call");
+  return stream;
+}
+
+// stream:reset() starts a new stream with the same settings, keeping the
+// state's memory.
+static int lmz_stream_reset(lua_State* L, const char* type) {
+  lmz_stream_t* stream = lmz_check_stream(L, type);
+  int status = stream->mode ? mz_inflateReset(&stream->stream) : mz_deflateReset(&stream->stream);
+  if (status != MZ_OK) {
+    const char* msg = mz_error(status);
+    return luaL_error(L, "Problem resetting stream: %s", msg ? msg : "unknown error");
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+// stream:close() gives the state back to the pool right away instead of at
+// garbage collection. The stream can't be used afterwards.
+static int lmz_stream_close(lua_State* L, const char* type) {
+  lmz_stream_t* stream = luaL_checkudata(L, 1, type);
+  if (stream->busy) return luaL_error(L, "Stream is busy with an async call");
+  lmz_pool_put(L, stream);
+  return 0;
+}
+
+static int lmz_deflator_reset(lua_State* L) {
+  return lmz_stream_reset(L, "miniz_deflator");
+}
+
+static int lmz_inflator_reset(lua_State* L) {
+  return lmz_stream_reset(L, "miniz_inflator");
+}
+
+static int lmz_deflator_close(lua_State* L) {
+  return lmz_stream_close(L, "miniz_deflator");
+}
+
+static int lmz_inflator_close(lua_State* L) {
+  return lmz_stream_close(L, "miniz_inflator");
+}
+
 static int lmz_deflator_deflate(lua_State* L) {
-  lmz_stream_t* stream = luaL_checkudata(L, 1, "miniz_deflator");
+  lmz_stream_t* stream = lmz_check_stream(L, "miniz_deflator");
   return lmz_inflator_deflator_impl(L, stream);
 }
 static int lmz_inflator_inflate(lua_State* L) {
-  lmz_stream_t* stream = luaL_checkudata(L, 1, "miniz_inflator");
+  lmz_stream_t* stream = lmz_check_stream(L, "miniz_inflator");
   return lmz_inflator_deflator_impl(L, stream);
 }
 
@@ -356,11 +2085,39 @@ static int ltdefl(lua_State* L) {
   return 1;
 }
 
+// miniz.zip_compress(data, level) compresses data the way writer:add does at
+// that level, so entries can be prepared on other threads and appended with
+// writer:add_raw. Returns the entry bytes, method and crc32 of data.
+static int lmz_zip_compress(lua_State* L) {
+  size_t in_len;
+  const char* in_buf = luaL_checklstring(L, 1, &in_len);
+  int level = luaL_optinteger(L, 2, MZ_DEFAULT_LEVEL);
+  mz_uint32 crc32 = lmz_crc32_update(MZ_CRC32_INIT, (const unsigned char*)in_buf, in_len);
+  if (level < 0 || level > MZ_UBER_COMPRESSION) {
+    return luaL_argerror(L, 2, "level must be between 0 and 10");
+  }
+  // miniz stores tiny entries whatever the level
+  if (level == 0 || in_len <= 3) {
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+  } else {
+    size_t out_len;
+    mz_uint flags = tdefl_create_comp_flags_from_zip_params(level, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+    char* out_buf = tdefl_compress_mem_to_heap(in_buf, in_len, &out_len, flags);
+    if (out_buf == NULL) return luaL_error(L, "Failure to compress entry");
+    lua_pushlstring(L, out_buf, out_len);
+    free(out_buf);
+    lua_pushinteger(L, MZ_DEFLATED);
+  }
+  lua_pushinteger(L, crc32);
+  return 3;
+}
+
 static int lmz_adler32(lua_State* L) {
   mz_ulong adler = luaL_optinteger(L, 1, 1);
   size_t buf_len = 0;
   const unsigned char* ptr = (const unsigned char*)luaL_optlstring(L, 2, NULL, &buf_len);
-  adler = mz_adler32(adler, ptr, buf_len);
+  adler = lmz_adler32_update(adler, ptr, buf_len);
   lua_pushinteger(L, adler);
   return 1;
 }
@@ -369,16 +2126,61 @@ static int lmz_crc32(lua_State* L) {
   mz_ulong crc32 = luaL_optinteger(L, 1, 0);
   size_t buf_len = 0;
   const unsigned char* ptr = (const unsigned char*)luaL_optlstring(L, 2, NULL, &buf_len);
-  crc32 = mz_crc32(crc32, ptr, buf_len);
+  crc32 = lmz_crc32_update(crc32, ptr, buf_len);
   lua_pushinteger(L, crc32);
   return 1;
 }
 
+// miniz.checksums() tells which crc32 and adler32 implementations are used.
+static int lmz_checksums(lua_State* L) {
+  uv_once(&lmz_checksum_once, lmz_checksum_init);
+  lua_createtable(L, 0, 2);
+  lua_pushstring(L, lmz_crc32_name);
+  lua_setfield(L, -2, "crc32");
+  lua_pushstring(L, lmz_adler32_name);
+  lua_setfield(L, -2, "adler32");
+  return 1;
+}
+
 static int lmz_version(lua_State* L) {
   lua_pushstring(L, mz_version());
   return 1;
 }
 
+// The work behind compress and uncompress, apart from the lua API so async
+// jobs can run it on the threadpool. Return MZ_OK and a malloc'd result in
+// *out, or a miniz status.
+static int lmz_compress_mem(const unsigned char* in, size_t in_len, int level,
+                            unsigned char** out, size_t* out_len) {
+  mz_ulong len = mz_compressBound(in_len);
+  unsigned char* outb = malloc(len);
+  int ret;
+  if (outb == NULL) return MZ_MEM_ERROR;
+  ret = mz_compress2(outb, &len, in, in_len, level);
+  if (ret != MZ_OK) {
+    free(outb);
+    return ret;
+  }
+  *out = outb;
+  *out_len = len;
+  return MZ_OK;
+}
+
+// Inflate a zlib stream into out, which starts at the expected size. It
+// grows in place rather than starting over when the guess was too small.
+static int lmz_uncompress_mem(const unsigned char* in, size_t in_len, lmz_buffer_t* out) {
+  mz_stream stream;
+  int status, ended = 0;
+  memset(&stream, 0, sizeof(stream));
+  status = mz_inflateInit(&stream);
+  if (status != MZ_OK) return status;
+  status = lmz_stream_run(&stream, 1, in, in_len, MZ_FINISH, out, &ended);
+  mz_inflateEnd(&stream);
+  // Like mz_uncompress, a stream that ends early is broken
+  if (status == MZ_OK && !ended) status = MZ_DATA_ERROR;
+  return status;
+}
+
 static int lmz_compress(lua_State* L)
 {
   int level, ret;
@@ -388,59 +2190,971 @@ static int lmz_compress(lua_State* L)
   in_len = 0;
   inb = (const unsigned char *)luaL_checklstring(L, 1, &in_len);
   level = lmz_check_compression_level(L, 2);
-  out_len = mz_compressBound(in_len);
-  outb = malloc(out_len);
-  ret = mz_compress2(outb, &out_len, inb, in_len, level);
-  switch (ret) {
-    case MZ_OK:
-      lua_pushlstring(L, (const char*)outb, out_len);
-      ret = 1;
-      break;
-    default:
-      lua_pushnil(L);
-      lua_pushstring(L, mz_error(ret));
-      ret = 2;
-      break;
+  ret = lmz_compress_mem(inb, in_len, level, &outb, &out_len);
+  if (ret != MZ_OK) {
+    lua_pushnil(L);
+    lua_pushstring(L, mz_error(ret));
+    return 2;
   }
+  lua_pushlstring(L, (const char*)outb, out_len);
   free(outb);
-  return ret;
+  return 1;
+}
+
+static size_t lmz_check_uncompress_size(lua_State* L, int index, size_t in_len) {
+  lua_Integer out_len = luaL_optinteger(L, index, in_len * 2);
+  if (out_len < 1 || out_len > INT_MAX) {
+    luaL_error(L, "Initial buffer size must be between 1 and %d", INT_MAX);
+  }
+  return (size_t)out_len;
 }
 
+// miniz.uncompress(data [, size | buffer]) where size is the expected size
+// of the output, or the output goes into a miniz buffer and its length is
+// returned.
 static int lmz_uncompress(lua_State* L)
 {
   int ret;
-  size_t in_len, out_len;
+  size_t in_len;
   const unsigned char* inb;
-  unsigned char* outb;
+  lmz_buffer_t* target = NULL;
+  lmz_buffer_t local = { NULL, 0, 0 };
+  lmz_buffer_t* out = &local;
   in_len = 0;
   inb = (const unsigned char*)luaL_checklstring(L, 1, &in_len);
-  out_len = luaL_optinteger(L, 2, in_len * 2);
-  if (out_len < 1 || out_len > INT_MAX) {
-    luaL_error(L, "Initial buffer size must be between 1 and %d", INT_MAX);
+  if (lua_isuserdata(L, 2)) {
+    target = luaL_checkudata(L, 2, "miniz_buffer");
+    out = target;
+    out->len = 0;
+    if (!lmz_buffer_reserve(out, in_len * 2 + 1)) return luaL_error(L, "out of memory");
+  } else if (!lmz_buffer_reserve(out, lmz_check_uncompress_size(L, 2, in_len))) {
+    return luaL_error(L, "out of memory");
   }
-  do {
-    outb = malloc(out_len);
-    ret = mz_uncompress(outb, &out_len, inb, in_len);
-    if (ret == MZ_BUF_ERROR) {
-      out_len *= 2;
-      free(outb);
-    } else {
+  ret = lmz_uncompress_mem(inb, in_len, out);
+  if (ret != MZ_OK) {
+    free(local.data);
+    if (target) target->len = 0;
+    lua_pushnil(L);
+    lua_pushstring(L, mz_error(ret));
+    return 2;
+  }
+  if (target) {
+    lua_pushinteger(L, target->len);
+  } else {
+    lua_pushlstring(L, local.data, local.len);
+    free(local.data);
+  }
+  return 1;
+}
+
+// Async variants of compress, uncompress, deflate, inflate and the stream
+// methods run on the libuv threadpool. The input string is pinned with a
+// registry reference instead of being copied. Results go to a callback as
+// (err, data), or without one the calling coroutine yields and is resumed
+// with what the sync version would return. At most `limit` jobs per lua
+// state run at once (see miniz.async_limit), the rest wait in order, so
+// compression can't take every thread fs requests need. The blocks of
+// miniz.compress_parallel count against the same limit and wait in the same
+// queue.
+
+#define LMZ_ASYNC_KEY "miniz.async"
+#define LMZ_ASYNC_LIMIT 2
+
+enum lmz_job_kinds {
+  LMZ_JOB_COMPRESS,
+  LMZ_JOB_UNCOMPRESS,
+  LMZ_JOB_DEFLATE,
+  LMZ_JOB_INFLATE,
+  LMZ_JOB_STREAM
+};
+
+typedef struct lmz_work_s lmz_work_t;
+typedef void (*lmz_work_done_cb)(lmz_work_t* work, int status);
+
+typedef struct {
+  uv_loop_t* loop;
+  int limit;
+  int running;
+  int queued;
+  lmz_work_t* head;
+  lmz_work_t* tail;
+} lmz_async_t;
+
+// What jobs and parallel blocks have in common, it comes first in both.
+// done runs on the loop thread once the work is over, or right away with a
+// negative status when the threadpool wouldn't take it.
+struct lmz_work_s {
+  uv_work_t req;
+  lmz_async_t* async;
+  lmz_work_t* next;
+  uv_work_cb work;
+  lmz_work_done_cb done;
+};
+
+typedef struct {
+  lmz_work_t work;
+  luv_ctx_t* ctx;
+  lua_State* L;
+  int kind;
+  int arg; // level, flags or flush
+  size_t size_hint;
+  const unsigned char* in;
+  size_t in_len;
+  lmz_stream_t* stream;
+  int in_ref;
+  int stream_ref;
+  int cb_ref;
+  int thread_ref;
+  unsigned char* out;
+  size_t out_len;
+  int status;
+} lmz_job_t;
+
+static lmz_async_t* lmz_async_get(lua_State* L) {
+  lmz_async_t* async;
+  lua_getfield(L, LUA_REGISTRYINDEX, LMZ_ASYNC_KEY);
+  async = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (async == NULL) {
+    async = lua_newuserdata(L, sizeof(*async));
+    memset(async, 0, sizeof(*async));
+    async->loop = luv_loop(L);
+    async->limit = LMZ_ASYNC_LIMIT;
+    lua_setfield(L, LUA_REGISTRYINDEX, LMZ_ASYNC_KEY);
+  }
+  return async;
+}
+
+static void lmz_async_work(uv_work_t* req) {
+  lmz_job_t* job = req->data;
+  lmz_buffer_t out = { NULL, 0, 0 };
+  switch (job->kind) {
+    case LMZ_JOB_COMPRESS:
+      job->status = lmz_compress_mem(job->in, job->in_len, job->arg, &job->out, &job->out_len);
+      return;
+    case LMZ_JOB_DEFLATE:
+      job->out = tdefl_compress_mem_to_heap(job->in, job->in_len, &job->out_len, job->arg);
+      job->status = job->out ? MZ_OK : MZ_DATA_ERROR;
+      return;
+    case LMZ_JOB_INFLATE:
+      job->out = tinfl_decompress_mem_to_heap(job->in, job->in_len, &job->out_len, job->arg);
+      job->status = job->out || job->in_len == 0 ? MZ_OK : MZ_DATA_ERROR;
+      return;
+    case LMZ_JOB_UNCOMPRESS:
+      job->status = lmz_buffer_reserve(&out, job->size_hint) ?
+        lmz_uncompress_mem(job->in, job->in_len, &out) : MZ_MEM_ERROR;
       break;
-    }
-  } while (out_len > 1 && out_len < INT_MAX);
-  switch (ret) {
-    case MZ_OK:
-      lua_pushlstring(L, (const char*)outb, out_len);
-      ret = 1;
+    case LMZ_JOB_STREAM:
+      job->status = lmz_buffer_reserve(&out, job->size_hint) ?
+        lmz_stream_run(&job->stream->stream, job->stream->mode, job->in, job->in_len, job->arg, &out, NULL) :
+        MZ_MEM_ERROR;
       break;
-    default:
+  }
+  if (job->status == MZ_OK) {
+    job->out = (unsigned char*)out.data;
+    job->out_len = out.len;
+  } else {
+    free(out.data);
+  }
+}
+
+static void lmz_async_drain(lmz_async_t* async);
+
+// The freed slot goes to the queue first. done may queue more, such as the
+// next block of a parallel job, so drain again after it.
+static void lmz_work_after(uv_work_t* req, int status) {
+  lmz_work_t* work = (lmz_work_t*)req;
+  lmz_async_t* async = work->async;
+  async->running--;
+  lmz_async_drain(async);
+  work->done(work, status);
+  lmz_async_drain(async);
+}
+
+// Hand work to the threadpool. Returns the libuv error when it's refused,
+// in which case it isn't counted as running.
+static int lmz_async_start(lmz_work_t* work) {
+  int rc = uv_queue_work(work->async->loop, &work->req, work->work, lmz_work_after);
+  if (rc == 0) work->async->running++;
+  return rc;
+}
+
+static void lmz_async_push(lmz_work_t* work) {
+  lmz_async_t* async = work->async;
+  work->next = NULL;
+  if (async->tail) {
+    async->tail->next = work;
+  } else {
+    async->head = work;
+  }
+  async->tail = work;
+  async->queued++;
+}
+
+// Start queued work while there's room under the limit. Work the threadpool
+// refuses is done at once with the error.
+static void lmz_async_drain(lmz_async_t* async) {
+  while (async->head && async->running < async->limit) {
+    lmz_work_t* next = async->head;
+    int rc;
+    async->head = next->next;
+    if (async->head == NULL) async->tail = NULL;
+    async->queued--;
+    rc = lmz_async_start(next);
+    if (rc < 0) next->done(next, rc);
+  }
+}
+
+// Resume the coroutine at 1 with the values after it, without going through
+// the global coroutine.resume the script may have replaced. Whatever it
+// yields next is dropped, errors are raised again so they surface like any
+// error in a luv callback.
+static int lmz_async_resume(lua_State* L) {
+  lua_State* co = lua_tothread(L, 1);
+  int n = lua_gettop(L) - 1;
+  int status;
+#if LUA_VERSION_NUM >= 504
+  int nres;
+#endif
+  if (lua_status(co) != LUA_YIELD) {
+    return luaL_error(L, "cannot resume non-suspended coroutine");
+  }
+  lua_xmove(L, co, n);
+#if LUA_VERSION_NUM >= 504
+  status = lua_resume(co, L, n, &nres);
+#elif LUA_VERSION_NUM >= 502
+  status = lua_resume(co, L, n);
+#else
+  status = lua_resume(co, n);
+#endif
+  if (status != 0 && status != LUA_YIELD) {
+    lua_xmove(co, L, 1);
+    return lua_error(L);
+  }
+#if LUA_VERSION_NUM >= 504
+  lua_pop(co, nres);
+#else
+  lua_settop(co, 0);
+#endif
+  return 0;
+}
+
+// Hand a finished job's result or error to its callback or coroutine.
+static void lmz_async_deliver(luv_ctx_t* ctx, lua_State* L, int cb_ref, int thread_ref,
+                              const char* err, const unsigned char* out, size_t out_len) {
+  int nargs;
+  if (cb_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cb_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, cb_ref);
+    if (err) {
+      lua_pushstring(L, err);
+      nargs = 1;
+    } else {
       lua_pushnil(L);
-      lua_pushstring(L, mz_error(ret));
-      ret = 2;
-      break;
+      lua_pushlstring(L, (const char*)out, out_len);
+      nargs = 2;
+    }
+  } else {
+    lua_pushcfunction(L, lmz_async_resume);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, thread_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, thread_ref);
+    if (err) {
+      lua_pushnil(L);
+      lua_pushstring(L, err);
+    } else {
+      lua_pushlstring(L, (const char*)out, out_len);
+      lua_pushnil(L);
+    }
+    nargs = 3;
   }
-  free(outb);
-  return ret;
+  ctx->cb_pcall(L, nargs, 0, 0);
+}
+
+static const char* lmz_async_error(int status, int mz_status) {
+  const char* err;
+  if (status < 0) return uv_strerror(status);
+  if (mz_status == MZ_OK) return NULL;
+  err = mz_error(mz_status);
+  return err ? err : "Problem processing data";
+}
+
+// Let go of what a job holds on to, except the callback or coroutine.
+static void lmz_async_release(lmz_job_t* job) {
+  lua_State* L = job->L;
+  luaL_unref(L, LUA_REGISTRYINDEX, job->in_ref);
+  if (job->stream) {
+    job->stream->busy = 0;
+    luaL_unref(L, LUA_REGISTRYINDEX, job->stream_ref);
+  }
+}
+
+static void lmz_async_done(lmz_work_t* work, int status) {
+  lmz_job_t* job = (lmz_job_t*)work;
+  lmz_async_release(job);
+  lmz_async_deliver(job->ctx, job->L, job->cb_ref, job->thread_ref,
+                    lmz_async_error(status, job->status), job->out, job->out_len);
+  free(job->out);
+  free(job);
+}
+
+// Move the callback from the end of the arguments to nargs + 1, past all
+// the sync version reads, so the rest can be checked like the sync version's
+// before anything is referenced. Returns the callback's index or 0 when
+// there's none, which is only allowed inside a coroutine.
+static int lmz_async_callback(lua_State* L, int nargs) {
+  int top = lua_gettop(L);
+  if (top > 1 && lua_type(L, top) == LUA_TFUNCTION) {
+    if (top < nargs + 1) lua_settop(L, nargs + 1);
+    lua_pushvalue(L, top);
+    lua_pushnil(L);
+    lua_replace(L, top);
+    lua_replace(L, nargs + 1);
+    lua_settop(L, nargs + 1);
+    return nargs + 1;
+  }
+  if (lua_pushthread(L)) {
+    return luaL_error(L, "Expected a callback when not called from a coroutine");
+  }
+  lua_pop(L, 1);
+  return 0;
+}
+
+// Reference the callback at cb, once all arguments have been checked.
+static int lmz_async_ref(lua_State* L, int cb) {
+  if (cb == 0) return LUA_NOREF;
+  lua_pushvalue(L, cb);
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Queue a job on the string at 1 (or 2 for stream methods, with the stream
+// at 1). Returns what the lua function should return.
+static int lmz_async_submit(lua_State* L, lmz_job_t* job, int cb, int input) {
+  lmz_async_t* async = lmz_async_get(L);
+  int cb_ref = lmz_async_ref(L, cb);
+  job->work.req.data = job;
+  job->work.async = async;
+  job->work.work = lmz_async_work;
+  job->work.done = lmz_async_done;
+  job->ctx = luv_context(L);
+  job->L = job->ctx->L;
+  job->out = NULL;
+  job->out_len = 0;
+  job->cb_ref = cb_ref;
+  job->thread_ref = LUA_NOREF;
+  job->in = (const unsigned char*)lua_tolstring(L, input, &job->in_len);
+  lua_pushvalue(L, input);
+  job->in_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  job->stream_ref = LUA_NOREF;
+  if (job->stream) {
+    lua_pushvalue(L, 1);
+    job->stream_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    job->stream->busy = 1;
+  }
+  if (cb_ref == LUA_NOREF) {
+    lua_pushthread(L);
+    job->thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  if (async->running >= async->limit) {
+    lmz_async_push(&job->work);
+  } else {
+    int rc = lmz_async_start(&job->work);
+    if (rc < 0) {
+      lmz_async_release(job);
+      luaL_unref(L, LUA_REGISTRYINDEX, job->cb_ref);
+      luaL_unref(L, LUA_REGISTRYINDEX, job->thread_ref);
+      free(job);
+      return luaL_error(L, "%s", uv_strerror(rc));
+    }
+  }
+  if (cb_ref == LUA_NOREF) return lua_yield(L, 0);
+  return 0;
+}
+
+static lmz_job_t* lmz_async_job(lua_State* L, int kind) {
+  lmz_job_t* job = malloc(sizeof(*job));
+  if (job == NULL) luaL_error(L, "out of memory");
+  memset(job, 0, sizeof(*job));
+  job->kind = kind;
+  return job;
+}
+
+// miniz.compress_async(data [, level], callback)
+static int lmz_compress_async(lua_State* L) {
+  int cb = lmz_async_callback(L, 2);
+  int level;
+  lmz_job_t* job;
+  luaL_checkstring(L, 1);
+  level = lmz_check_compression_level(L, 2);
+  job = lmz_async_job(L, LMZ_JOB_COMPRESS);
+  job->arg = level;
+  return lmz_async_submit(L, job, cb, 1);
+}
+
+// miniz.uncompress_async(data [, initial_size], callback)
+static int lmz_uncompress_async(lua_State* L) {
+  int cb = lmz_async_callback(L, 2);
+  size_t in_len, size_hint;
+  lmz_job_t* job;
+  luaL_checklstring(L, 1, &in_len);
+  size_hint = lmz_check_uncompress_size(L, 2, in_len);
+  job = lmz_async_job(L, LMZ_JOB_UNCOMPRESS);
+  job->size_hint = size_hint;
+  return lmz_async_submit(L, job, cb, 1);
+}
+
+// miniz.deflate_async(data [, flags], callback)
+static int lmz_deflate_async(lua_State* L) {
+  int cb = lmz_async_callback(L, 2);
+  lmz_job_t* job;
+  int flags;
+  luaL_checkstring(L, 1);
+  flags = luaL_optinteger(L, 2, 0);
+  job = lmz_async_job(L, LMZ_JOB_DEFLATE);
+  job->arg = flags;
+  return lmz_async_submit(L, job, cb, 1);
+}
+
+// miniz.inflate_async(data [, flags], callback)
+static int lmz_inflate_async(lua_State* L) {
+  int cb = lmz_async_callback(L, 2);
+  lmz_job_t* job;
+  int flags;
+  luaL_checkstring(L, 1);
+  flags = luaL_optinteger(L, 2, 0);
+  job = lmz_async_job(L, LMZ_JOB_INFLATE);
+  job->arg = flags;
+  return lmz_async_submit(L, job, cb, 1);
+}
+
+// stream:deflate_async(data [, flush [, size]], callback) and inflate_async.
+// The stream can't be used for anything else until the result is in.
+static int lmz_stream_async(lua_State* L, const char* type) {
+  int cb = lmz_async_callback(L, 4);
+  lmz_stream_t* stream = lmz_check_stream(L, type);
+  lmz_job_t* job;
+  lua_Integer opt;
+  int flush;
+  luaL_checkstring(L, 2);
+  flush = luaL_checkoption(L, 3, "no", flush_types);
+  opt = luaL_optinteger(L, 4, 0);
+  luaL_argcheck(L, opt >= 0, 4, "output size must not be negative");
+  job = lmz_async_job(L, LMZ_JOB_STREAM);
+  job->arg = flush;
+  job->stream = stream;
+  job->size_hint = opt ? (size_t)opt : lmz_stream_out_hint(stream, lua_rawlen(L, 2));
+  return lmz_async_submit(L, job, cb, 2);
+}
+
+static int lmz_deflator_deflate_async(lua_State* L) {
+  return lmz_stream_async(L, "miniz_deflator");
+}
+
+static int lmz_inflator_inflate_async(lua_State* L) {
+  return lmz_stream_async(L, "miniz_inflator");
+}
+
+// miniz.async_limit([limit]) sets how many async jobs and parallel blocks of
+// this lua state run at once and returns the limit and how many are running
+// and queued.
+static int lmz_async_limit(lua_State* L) {
+  lmz_async_t* async = lmz_async_get(L);
+  if (!lua_isnoneornil(L, 1)) {
+    int limit = (int)luaL_checkinteger(L, 1);
+    luaL_argcheck(L, limit >= 1, 1, "limit must be at least 1");
+    async->limit = limit;
+    lmz_async_drain(async);
+  }
+  lua_pushinteger(L, async->limit);
+  lua_pushinteger(L, async->running);
+  lua_pushinteger(L, async->queued);
+  return 3;
+}
+
+// miniz.compress_parallel splits its input into blocks compressed at the same
+// time on the threadpool, like pigz. Every block but the last ends with a
+// sync flush, so the raw deflate outputs can simply be put one after the
+// other, and each block is primed with the 32KB before it so matches can
+// reach back across block boundaries. tdefl has no way to set a dictionary,
+// so priming compresses those 32KB first and throws the output away. The
+// checksums of the blocks are combined into the one of the whole input.
+
+#define LMZ_PARALLEL_BLOCK (128 * 1024)
+#define LMZ_DICT_SIZE 32768
+
+enum lmz_parallel_formats { LMZ_FORMAT_ZLIB, LMZ_FORMAT_RAW, LMZ_FORMAT_GZIP };
+
+static const char* parallel_formats[] = { "zlib", "raw", "gzip", NULL };
+
+typedef struct lmz_parallel_s lmz_parallel_t;
+
+typedef struct {
+  lmz_work_t work;
+  lmz_parallel_t* job;
+  size_t offset;
+  size_t len;
+  int discard; // priming, drop the output
+  unsigned char* out;
+  size_t out_len;
+  size_t out_cap;
+  mz_uint32 check;
+  int status;
+} lmz_block_t;
+
+struct lmz_parallel_s {
+  luv_ctx_t* ctx;
+  lua_State* L;
+  const unsigned char* in;
+  size_t in_len;
+  int in_ref;
+  int cb_ref;
+  int thread_ref;
+  int level;
+  int format;
+  mz_uint flags;
+  int count;
+  int next;
+  int running; // blocks queued or running
+  int threads;
+  int submitting;
+  int status;
+  int uv_status;
+  lmz_block_t blocks[1];
+};
+
+// The zlib way of combining checksums: crc32 by multiplying with the matrix
+// of len2 zero bytes over GF(2), adler32 with a bit of modular arithmetic.
+static mz_uint32 lmz_gf2_times(const mz_uint32* mat, mz_uint32 vec) {
+  mz_uint32 sum = 0;
+  while (vec) {
+    if (vec & 1) sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void lmz_gf2_square(mz_uint32* square, const mz_uint32* mat) {
+  int n;
+  for (n = 0; n < 32; n++) {
+    square[n] = lmz_gf2_times(mat, mat[n]);
+  }
+}
+
+static mz_uint32 lmz_crc32_combine(mz_uint32 crc1, mz_uint32 crc2, mz_uint64 len2) {
+  mz_uint32 even[32], odd[32], row = 1;
+  int n;
+  if (len2 == 0) return crc1;
+  odd[0] = 0xedb88320;
+  for (n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  lmz_gf2_square(even, odd);
+  lmz_gf2_square(odd, even);
+  for (;;) {
+    lmz_gf2_square(even, odd);
+    if (len2 & 1) crc1 = lmz_gf2_times(even, crc1);
+    len2 >>= 1;
+    if (len2 == 0) break;
+    lmz_gf2_square(odd, even);
+    if (len2 & 1) crc1 = lmz_gf2_times(odd, crc1);
+    len2 >>= 1;
+    if (len2 == 0) break;
+  }
+  return crc1 ^ crc2;
+}
+
+static mz_uint32 lmz_adler32_combine(mz_uint32 adler1, mz_uint32 adler2, mz_uint64 len2) {
+  const mz_uint32 base = 65521;
+  mz_uint32 rem = (mz_uint32)(len2 % base);
+  mz_uint32 sum1 = adler1 & 0xffff;
+  mz_uint32 sum2 = (mz_uint32)(((mz_uint64)rem * sum1) % base);
+  sum1 += (adler2 & 0xffff) + base - 1;
+  sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + base - rem;
+  if (sum1 >= base) sum1 -= base;
+  if (sum1 >= base) sum1 -= base;
+  if (sum2 >= (base << 1)) sum2 -= (base << 1);
+  if (sum2 >= base) sum2 -= base;
+  return sum1 | (sum2 << 16);
+}
+
+static mz_bool lmz_block_put(const void* buf, int len, void* user) {
+  lmz_block_t* block = user;
+  if (block->discard) return MZ_TRUE;
+  if (block->out_len + len > block->out_cap) {
+    size_t cap = block->out_cap ? block->out_cap : 4096;
+    unsigned char* grown;
+    while (cap < block->out_len + len) cap *= 2;
+    grown = realloc(block->out, cap);
+    if (grown == NULL) return MZ_FALSE;
+    block->out = grown;
+    block->out_cap = cap;
+  }
+  memcpy(block->out + block->out_len, buf, len);
+  block->out_len += len;
+  return MZ_TRUE;
+}
+
+static void lmz_block_work(uv_work_t* req) {
+  lmz_block_t* block = req->data;
+  lmz_parallel_t* job = block->job;
+  const unsigned char* in = job->in + block->offset;
+  int last = block->offset + block->len == job->in_len;
+  tdefl_compressor* comp = malloc(sizeof(tdefl_compressor));
+  tdefl_status status;
+  if (comp == NULL) {
+    block->status = MZ_MEM_ERROR;
+    return;
+  }
+  tdefl_init(comp, lmz_block_put, block, job->flags);
+  if (block->offset > 0) {
+    size_t dict = block->offset < LMZ_DICT_SIZE ? block->offset : LMZ_DICT_SIZE;
+    block->discard = 1;
+    status = tdefl_compress_buffer(comp, in - dict, dict, TDEFL_SYNC_FLUSH);
+    block->discard = 0;
+    if (status != TDEFL_STATUS_OKAY) goto fail;
+  }
+  status = tdefl_compress_buffer(comp, in, block->len, last ? TDEFL_FINISH : TDEFL_SYNC_FLUSH);
+  if (status != (last ? TDEFL_STATUS_DONE : TDEFL_STATUS_OKAY)) goto fail;
+  free(comp);
+  if (job->format == LMZ_FORMAT_ZLIB) {
+    block->check = lmz_adler32_update(MZ_ADLER32_INIT, in, block->len);
+  } else if (job->format == LMZ_FORMAT_GZIP) {
+    block->check = lmz_crc32_update(MZ_CRC32_INIT, in, block->len);
+  }
+  block->status = MZ_OK;
+  return;
+
+fail:
+  free(comp);
+  block->status = status == TDEFL_STATUS_PUT_BUF_FAILED ? MZ_MEM_ERROR : MZ_STREAM_ERROR;
+}
+
+// Queue blocks up to the job's own thread count. They start as the async
+// limit allows, in turn with other jobs of the lua state.
+static void lmz_parallel_dispatch(lmz_parallel_t* job) {
+  while (job->status == MZ_OK && job->next < job->count && job->running < job->threads) {
+    lmz_block_t* block = &job->blocks[job->next++];
+    job->running++;
+    lmz_async_push(&block->work);
+  }
+}
+
+// Header, blocks and trailer in one buffer.
+static unsigned char* lmz_parallel_join(lmz_parallel_t* job, size_t* out_len) {
+  unsigned char* out;
+  unsigned char* p;
+  size_t len = 0;
+  mz_uint32 check = job->format == LMZ_FORMAT_ZLIB ? MZ_ADLER32_INIT : MZ_CRC32_INIT;
+  int i;
+  for (i = 0; i < job->count; i++) {
+    len += job->blocks[i].out_len;
+  }
+  len += job->format == LMZ_FORMAT_ZLIB ? 2 + 4 : job->format == LMZ_FORMAT_GZIP ? 10 + 8 : 0;
+  out = malloc(len ? len : 1);
+  if (out == NULL) return NULL;
+  p = out;
+  if (job->format == LMZ_FORMAT_ZLIB) {
+    int level = job->level;
+    mz_uint32 header = 0x7800 | ((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6);
+    header += 31 - header % 31;
+    *p++ = (unsigned char)(header >> 8);
+    *p++ = (unsigned char)header;
+  } else if (job->format == LMZ_FORMAT_GZIP) {
+    static const unsigned char gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+    memcpy(p, gzip_header, 10);
+    p[8] = job->level == 9 ? 2 : job->level == 1 ? 4 : 0;
+    p += 10;
+  }
+  for (i = 0; i < job->count; i++) {
+    lmz_block_t* block = &job->blocks[i];
+    if (block->out_len) memcpy(p, block->out, block->out_len);
+    p += block->out_len;
+    if (job->format == LMZ_FORMAT_ZLIB) {
+      check = lmz_adler32_combine(check, block->check, block->len);
+    } else if (job->format == LMZ_FORMAT_GZIP) {
+      check = lmz_crc32_combine(check, block->check, block->len);
+    }
+  }
+  if (job->format == LMZ_FORMAT_ZLIB) {
+    p[0] = (unsigned char)(check >> 24);
+    p[1] = (unsigned char)(check >> 16);
+    p[2] = (unsigned char)(check >> 8);
+    p[3] = (unsigned char)check;
+  } else if (job->format == LMZ_FORMAT_GZIP) {
+    lmz_write_le32(p, check);
+    lmz_write_le32(p + 4, (mz_uint32)job->in_len);
+  }
+  *out_len = len;
+  return out;
+}
+
+static void lmz_parallel_free(lmz_parallel_t* job) {
+  int i;
+  for (i = 0; i < job->count; i++) {
+    free(job->blocks[i].out);
+  }
+  luaL_unref(job->L, LUA_REGISTRYINDEX, job->in_ref);
+  free(job);
+}
+
+static void lmz_block_done(lmz_work_t* work, int status) {
+  lmz_block_t* block = (lmz_block_t*)work;
+  lmz_parallel_t* job = block->job;
+  unsigned char* out = NULL;
+  size_t out_len = 0;
+  job->running--;
+  if (job->status == MZ_OK) {
+    job->status = status < 0 ? MZ_STREAM_ERROR : block->status;
+    if (status < 0) job->uv_status = status;
+  }
+  lmz_parallel_dispatch(job);
+  // A block refused while compress_parallel is still queueing is reported
+  // by it instead.
+  if (job->running || job->submitting) return;
+  if (job->status == MZ_OK) {
+    out = lmz_parallel_join(job, &out_len);
+    if (out == NULL) job->status = MZ_MEM_ERROR;
+  }
+  lmz_async_deliver(job->ctx, job->L, job->cb_ref, job->thread_ref,
+                    lmz_async_error(job->uv_status, job->status), out, out_len);
+  free(out);
+  lmz_parallel_free(job);
+}
+
+// Queue up to all but one threadpool thread's worth of blocks by default.
+// How many of them run at once is still up to miniz.async_limit.
+static int lmz_parallel_threads(void) {
+  const char* env = getenv("UV_THREADPOOL_SIZE");
+  int size = env ? atoi(env) : 4;
+  if (size < 1) size = 4;
+  if (size > 1024) size = 1024;
+  return size > 1 ? size - 1 : 1;
+}
+
+// miniz.compress_parallel(data [, level [, format [, block_size [, threads]]]], callback)
+// compresses data into a single zlib, raw deflate or gzip stream.
+static int lmz_compress_parallel(lua_State* L) {
+  int cb = lmz_async_callback(L, 5);
+  size_t in_len, count, block_size;
+  lua_Integer opt;
+  int level, format, threads, i;
+  lmz_parallel_t* job;
+  lmz_async_t* async;
+  const char* in = luaL_checklstring(L, 1, &in_len);
+  level = lmz_check_compression_level(L, 2);
+  if (level == MZ_DEFAULT_COMPRESSION) level = MZ_DEFAULT_LEVEL;
+  format = luaL_checkoption(L, 3, "zlib", parallel_formats);
+  opt = luaL_optinteger(L, 4, LMZ_PARALLEL_BLOCK);
+  luaL_argcheck(L, opt >= 1024 && opt <= INT_MAX, 4, "block size must be between 1024 and 2^31");
+  block_size = (size_t)opt;
+  opt = luaL_optinteger(L, 5, lmz_parallel_threads());
+  luaL_argcheck(L, opt >= 1 && opt <= 1024, 5, "threads must be between 1 and 1024");
+  threads = (int)opt;
+  count = in_len ? (in_len + block_size - 1) / block_size : 1;
+  if (count > INT_MAX / sizeof(lmz_block_t)) return luaL_error(L, "Too many blocks");
+  async = lmz_async_get(L);
+  job = malloc(sizeof(lmz_parallel_t) + (count - 1) * sizeof(lmz_block_t));
+  if (job == NULL) return luaL_error(L, "out of memory");
+  memset(job, 0, sizeof(lmz_parallel_t) + (count - 1) * sizeof(lmz_block_t));
+  job->ctx = luv_context(L);
+  job->L = job->ctx->L;
+  job->in = (const unsigned char*)in;
+  job->in_len = in_len;
+  job->level = level;
+  job->format = format;
+  job->flags = tdefl_create_comp_flags_from_zip_params(level, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+  job->count = (int)count;
+  job->threads = threads;
+  job->status = MZ_OK;
+  for (i = 0; i < job->count; i++) {
+    lmz_block_t* block = &job->blocks[i];
+    block->work.req.data = block;
+    block->work.async = async;
+    block->work.work = lmz_block_work;
+    block->work.done = lmz_block_done;
+    block->job = job;
+    block->offset = (size_t)i * block_size;
+    block->len = i == job->count - 1 ? in_len - block->offset : block_size;
+  }
+  lua_pushvalue(L, 1);
+  job->in_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  job->cb_ref = lmz_async_ref(L, cb);
+  job->thread_ref = LUA_NOREF;
+  if (job->cb_ref == LUA_NOREF) {
+    lua_pushthread(L);
+    job->thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  job->submitting = 1;
+  lmz_parallel_dispatch(job);
+  lmz_async_drain(async);
+  job->submitting = 0;
+  if (job->running == 0) {
+    const char* err = lmz_async_error(job->uv_status, job->status);
+    luaL_unref(L, LUA_REGISTRYINDEX, job->cb_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, job->thread_ref);
+    lmz_parallel_free(job);
+    return luaL_error(L, "%s", err);
+  }
+  if (job->cb_ref == LUA_NOREF) return lua_yield(L, 0);
+  return 0;
+}
+
+// reader:open_stream(index [, flags]) opens an entry for reading in chunks,
+// so huge entries never have to exist as one string.
+static int lmz_reader_open_stream(lua_State *L) {
+  lmz_file_t* zip = luaL_checkudata(L, 1, "miniz_reader");
+  mz_uint file_index = (mz_uint)luaL_checkinteger(L, 2) - 1;
+  mz_uint flags = luaL_optinteger(L, 3, 0);
+  mz_zip_reader_extract_iter_state* iter;
+  lmz_entry_stream_t* stream;
+  iter = mz_zip_reader_extract_iter_new(&(zip->archive), file_index, flags);
+  if (iter == NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, mz_zip_get_error_string(mz_zip_get_last_error(&(zip->archive))));
+    return 2;
+  }
+  stream = lua_newuserdata(L, sizeof(*stream));
+  stream->iter = iter;
+  stream->size = (flags & MZ_ZIP_FLAG_COMPRESSED_DATA) ?
+    iter->file_stat.m_comp_size : iter->file_stat.m_uncomp_size;
+  stream->done = 0;
+  stream->verify = !(flags & MZ_ZIP_FLAG_COMPRESSED_DATA);
+  stream->crc32 = MZ_CRC32_INIT;
+  lua_pushvalue(L, 1);
+  stream->reader_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  luaL_getmetatable(L, "miniz_entry_stream");
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+// Free the iterator and let go of the reader. Returns false when miniz found
+// the entry corrupt (for fully read entries this includes the crc check).
+static int lmz_entry_stream_release(lua_State* L, lmz_entry_stream_t* stream) {
+  int ok = mz_zip_reader_extract_iter_free(stream->iter);
+  stream->iter = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, stream->reader_ref);
+  stream->reader_ref = LUA_NOREF;
+  return ok;
+}
+
+// stream:read([size]) returns the next chunk of at most size bytes (64KB by
+// default) or nil once the entry is done. Nothing is inflated ahead of what
+// is read, so a slow consumer holds at most one chunk.
+static int lmz_entry_stream_read(lua_State* L) {
+  lmz_entry_stream_t* stream = luaL_checkudata(L, 1, "miniz_entry_stream");
+  size_t size = luaL_optinteger(L, 2, LMZ_STREAM_CHUNK);
+  size_t n;
+  luaL_Buffer buf;
+  if (stream->iter == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (size == 0) size = LMZ_STREAM_CHUNK;
+  if (size > stream->size - stream->done) size = (size_t)(stream->size - stream->done);
+  if (size == 0) {
+    mz_zip_archive* archive = stream->iter->pZip;
+    if (stream->verify && stream->crc32 != stream->iter->file_stat.m_crc32) {
+      lmz_entry_stream_release(L, stream);
+      lua_pushnil(L);
+      lua_pushliteral(L, "stream failed the crc check");
+      return 2;
+    }
+    lua_pushnil(L);
+    if (lmz_entry_stream_release(L, stream)) return 1;
+    lua_pushstring(L, mz_zip_get_error_string(mz_zip_get_last_error(archive)));
+    return 2;
+  }
+  luaL_buffinit(L, &buf);
+  while (size > 0) {
+    size_t want = size < LUAL_BUFFERSIZE ? size : LUAL_BUFFERSIZE;
+    char* chunk = luaL_prepbuffer(&buf);
+    n = mz_zip_reader_extract_iter_read(stream->iter, chunk, want);
+    if (stream->verify) stream->crc32 = lmz_crc32_update(stream->crc32, (const unsigned char*)chunk, n);
+    luaL_addsize(&buf, n);
+    stream->done += n;
+    size -= n;
+    if (n < want) break;
+  }
+  if (stream->iter->status < 0 || (size > 0 && stream->done < stream->size)) {
+    mz_zip_archive* archive = stream->iter->pZip;
+    luaL_pushresult(&buf);
+    lua_pop(L, 1);
+    lmz_entry_stream_release(L, stream);
+    lua_pushnil(L);
+    lua_pushfstring(L, "stream failed because of %s",
+      mz_zip_get_error_string(mz_zip_get_last_error(archive)));
+    return 2;
+  }
+  luaL_pushresult(&buf);
+  return 1;
+}
+
+static int lmz_entry_stream_size(lua_State* L) {
+  lmz_entry_stream_t* stream = luaL_checkudata(L, 1, "miniz_entry_stream");
+  lua_pushinteger(L, stream->size);
+  return 1;
+}
+
+static int lmz_entry_stream_close(lua_State* L) {
+  lmz_entry_stream_t* stream = luaL_checkudata(L, 1, "miniz_entry_stream");
+  if (stream->iter) lmz_entry_stream_release(L, stream);
+  return 0;
+}
+
+static int lmz_buffer_init(lua_State* L) {
+  size_t cap = luaL_optinteger(L, 1, 0);
+  lmz_buffer_t* buffer = lua_newuserdata(L, sizeof(*buffer));
+  buffer->data = NULL;
+  buffer->len = 0;
+  buffer->cap = 0;
+  luaL_getmetatable(L, "miniz_buffer");
+  lua_setmetatable(L, -2);
+  if (cap > 0) {
+    buffer->data = malloc(cap);
+    if (buffer->data == NULL) return luaL_error(L, "out of memory");
+    buffer->cap = cap;
+  }
+  return 1;
+}
+
+static int lmz_buffer_gc(lua_State* L) {
+  lmz_buffer_t* buffer = luaL_checkudata(L, 1, "miniz_buffer");
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->len = buffer->cap = 0;
+  return 0;
+}
+
+static int lmz_buffer_size(lua_State* L) {
+  lmz_buffer_t* buffer = luaL_checkudata(L, 1, "miniz_buffer");
+  lua_pushinteger(L, buffer->len);
+  return 1;
+}
+
+static int lmz_buffer_capacity(lua_State* L) {
+  lmz_buffer_t* buffer = luaL_checkudata(L, 1, "miniz_buffer");
+  lua_pushinteger(L, buffer->cap);
+  return 1;
+}
+
+// buffer:tostring([i [, j]]) returns the bytes from i to j like string.sub,
+// so large entries can be sent in slices.
+static int lmz_buffer_tostring(lua_State* L) {
+  lmz_buffer_t* buffer = luaL_checkudata(L, 1, "miniz_buffer");
+  lua_Integer len = (lua_Integer)buffer->len;
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  lua_Integer j = luaL_optinteger(L, 3, -1);
+  if (i < 0) i = i + len + 1;
+  if (j < 0) j = j + len + 1;
+  if (i < 1) i = 1;
+  if (j > len) j = len;
+  if (i > j) {
+    lua_pushliteral(L, "");
+  } else {
+    lua_pushlstring(L, buffer->data + i - 1, (size_t)(j - i + 1));
+  }
+  return 1;
 }
 
 static const luaL_Reg lminiz_read_m[] = {
@@ -449,40 +3163,84 @@ static const luaL_Reg lminiz_read_m[] = {
   {"get_filename", lmz_reader_get_filename},
   {"is_directory", lmz_reader_is_file_a_directory},
   {"extract", lmz_reader_extract},
+  {"extract_into", lmz_reader_extract_into},
+  {"open_stream", lmz_reader_open_stream},
+  {"raw", lmz_reader_raw},
+  {"prefetch", lmz_reader_prefetch},
   {"locate_file", lmz_reader_locate_file},
+  {"locate", lmz_reader_locate},
+  {"stat_path", lmz_reader_stat_path},
+  {"readdir", lmz_reader_readdir},
   {"get_offset", lmz_reader_get_offset},
   {NULL, NULL}
 };
 
+static const luaL_Reg lminiz_buffer_m[] = {
+  {"size", lmz_buffer_size},
+  {"capacity", lmz_buffer_capacity},
+  {"tostring", lmz_buffer_tostring},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lminiz_entry_stream_m[] = {
+  {"read", lmz_entry_stream_read},
+  {"size", lmz_entry_stream_size},
+  {"close", lmz_entry_stream_close},
+  {NULL, NULL}
+};
+
 static const luaL_Reg lminiz_write_m[] = {
   {"add_from_zip", lmz_writer_add_from_zip_reader},
   {"add", lmz_writer_add_mem},
+  {"add_raw", lmz_writer_add_raw},
+  {"add_alias", lmz_writer_add_alias},
   {"finalize", lmz_writer_finalize},
   {NULL, NULL}
 };
 
 static const luaL_Reg lminiz_deflate_m[] = {
   {"deflate", lmz_deflator_deflate},
+  {"deflate_async", lmz_deflator_deflate_async},
+  {"reset", lmz_deflator_reset},
+  {"close", lmz_deflator_close},
   {NULL,NULL}
 };
 
 static const luaL_Reg lminiz_inflate_m[] = {
   {"inflate", lmz_inflator_inflate},
+  {"inflate_async", lmz_inflator_inflate_async},
+  {"reset", lmz_inflator_reset},
+  {"close", lmz_inflator_close},
   {NULL,NULL}
 };
 
 static const luaL_Reg lminiz_f[] = {
   {"new_reader", lmz_reader_init},
   {"new_writer", lmz_writer_init},
+  {"new_file_writer", lmz_file_writer_init},
+  {"new_callback_writer", lmz_callback_writer_init},
+  {"new_buffer", lmz_buffer_init},
+  {"probe", lmz_probe},
+  {"append_trailer", lmz_append_trailer},
   {"inflate", ltinfl},
   {"deflate", ltdefl},
+  {"zip_compress", lmz_zip_compress},
+  {"extract_cache", lmz_extract_cache},
   {"adler32", lmz_adler32},
   {"crc32", lmz_crc32},
+  {"checksums", lmz_checksums},
   {"compress", lmz_compress},
   {"uncompress", lmz_uncompress},
   {"version", lmz_version},
+  {"compress_async", lmz_compress_async},
+  {"uncompress_async", lmz_uncompress_async},
+  {"deflate_async", lmz_deflate_async},
+  {"inflate_async", lmz_inflate_async},
+  {"async_limit", lmz_async_limit},
+  {"compress_parallel", lmz_compress_parallel},
   {"new_deflator", lmz_deflator_init},
   {"new_inflator", lmz_inflator_init},
+  {"stream_pool", lmz_stream_pool},
   {NULL, NULL}
 };
 
@@ -493,6 +3251,20 @@ LUALIB_API int luaopen_miniz(lua_State *L) {
   lua_pushcfunction(L, lmz_reader_gc);
   lua_setfield(L, -2, "__gc");
   lua_pop(L, 1);
+  luaL_newmetatable(L, "miniz_buffer");
+  luaL_newlib(L, lminiz_buffer_m);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, lmz_buffer_size);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, lmz_buffer_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, "miniz_entry_stream");
+  luaL_newlib(L, lminiz_entry_stream_m);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, lmz_entry_stream_close);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
   luaL_newmetatable(L, "miniz_writer");
   luaL_newlib(L, lminiz_write_m);
   lua_setfield(L, -2, "__index");
@@ -49,7 +49,16 @@ local commands = {
   ["--compile"] = "compile",
   ["--force"] = "force",
   ["-s"] = "strip",
-  ["--strip"] = "strip"
+  ["--strip"] = "strip",
+  ["--level"] = "level",
+  ["--store"] = "store",
+  ["--deflate"] = "deflate",
+  ["--jobs"] = "jobs",
+  ["--clean"] = "clean",
+  ["--dedup"] = "dedup",
+  ["--manifest"] = "manifest",
+  ["--memory-limit"] = "memoryLimit",
+  ["--thread-memory-limit"] = "threadMemoryLimit",
 }
 
 local function version(args)
@@ -71,6 +80,23 @@ Usage: $(LUVI) bundle+ [options] [-- extra args]
   --compile         Compile Lua code into bytecode before bundling.
   --strip           Compile Lua code and strip debug info.
   --force           Ignore errors when compiling Lua code.
+  --level n         Compression level for bundled files, 0 stores them
+                    uncompressed (default 9).
+  --store globs     Comma separated globs of files to store uncompressed.
+  --deflate globs   Comma separated globs of files to compress at level 9.
+  --jobs n          Number of threads compiling and compressing files
+                    for --output (default: number of CPUs).
+  --clean           Rebuild every file instead of reusing unchanged ones
+                    from the previous --output target.
+  --dedup           Store the data of files with identical content once.
+  --manifest path   Put the files listed in a startup manifest first and
+                    store them uncompressed. Record one by running the app
+                    with LUVI_STARTUP_MANIFEST=path.
+  --memory-limit size
+                    Limit the memory of the main lua state (e.g. 512m).
+  --thread-memory-limit size
+                    Limit the memory of each uv.new_thread / uv.new_work
+                    lua state (e.g. 64m).
   --help            Show this help file.
   --                All args after this go to the luvi app itself.
 
@@ -89,6 +115,9 @@ Examples:
   $(LUVI) path/to/app -o target
   ./target some args
 
+  # Bundle with precompiled lua files stored, other files deflated
+  $(LUVI) path/to/app -o target --compile --store "*.lua"
+
   # Run unit tests for a luvi app using custom main
   $(LUVI) path/to/app -m tests/run.lua
 ]]
@@ -99,10 +128,13 @@ local EXIT_SUCCESS = 0
 
 return function(args)
 
-  -- First check for a bundled zip file appended to the executable
+  -- First check for a bundled zip file appended to the executable. Probing
+  -- only reads the last few bytes. Zips it can't place, like ones with an
+  -- archive comment of their own, are only searched for with LUVI_FIND_ZIP=1
+  -- so plain luvi never has to map itself.
   local path = uv.exepath()
-  local zip = miniz.new_reader(path)
-  if zip then
+  if miniz.probe(path) or
+     (os.getenv("LUVI_FIND_ZIP") == "1" and miniz.new_reader(path, 0, "mmap")) then
     return commonBundle({path}, nil, args)
   end
 
@@ -132,7 +164,10 @@ return function(args)
       if options[command] then
         error("Duplicate flags: " .. command)
       end
-      if command == "output" or command == "main" then
+      if command == "output" or command == "main" or
+         command == "level" or command == "store" or command == "deflate" or
+         command == "jobs" or command == "manifest" or
+         command == "memoryLimit" or command == "threadMemoryLimit" then
         key = command
       elseif command then
         options[command] = true
@@ -165,9 +200,32 @@ return function(args)
   -- Don't run app when printing version or help
   if options.version or options.help then return EXIT_SUCCESS end
 
+  if options.memoryLimit then
+    -- The main state is already running, so it can only be limited when it
+    -- was created with an accounting allocator
+    local ok, err = pcall(luvi.set_vm_memory_limit, options.memoryLimit)
+    if not ok then
+      io.stderr:write("Ignoring --memory-limit: " .. err ..
+        ", set LUVI_MEMORY_LIMIT or LUVI_ALLOCATOR instead\n")
+    end
+  end
+  if options.threadMemoryLimit then
+    luvi.set_thread_memory_limit(options.threadMemoryLimit)
+  end
+
   -- Build the app if output is given
   if options.output then
-    return buildBundle(options, makeBundle(bundles))
+    local rules = {}
+    for _, key in ipairs({ "store", "deflate" }) do
+      if options[key] then
+        for glob in options[key]:gmatch("[^,]+") do
+          rules[#rules + 1] = { glob, key == "store" and 0 or 9 }
+        end
+      end
+    end
+    options.rules = rules
+    buildBundle(options, makeBundle(bundles))
+    return EXIT_SUCCESS
   end
 
   -- Run the luvi app with the extra args
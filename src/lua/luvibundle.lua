@@ -10,13 +10,141 @@ local unpack     = unpack     or table.unpack
 
 local tmpBase = getenv("TMPDIR") or getenv("TMP") or getenv("TEMP") or (uv.fs_access("/tmp", "r") and "/tmp") or uv.cwd()
 
+local function readAll(path, length)
+  local fd, err = uv.fs_open(path, "r", 0)
+  if not fd then return nil, err end
+  local data
+  if not length then
+    local stat
+    stat, err = uv.fs_fstat(fd)
+    length = stat and stat.size
+  end
+  if length then
+    data, err = uv.fs_read(fd, length, 0)
+  end
+  uv.fs_close(fd)
+  return data, err
+end
+
+-- A per user folder under tmpBase (or the one named by env, which can also
+-- be "off") that only the user can write to, or false.
+local privateDirs = {}
+local function getPrivateDir(env, prefix)
+  local dir = privateDirs[env]
+  if dir ~= nil then return dir end
+  privateDirs[env] = false
+  dir = getenv(env)
+  if dir == "off" or dir == "0" then return false end
+  local user = uv.os_get_passwd and uv.os_get_passwd()
+  dir = dir or pathJoin(tmpBase, prefix .. (user and user.username or "user"))
+  uv.fs_mkdir(dir, 448) -- 0700
+  local stat = uv.fs_stat(dir)
+  if not stat or stat.type ~= "directory" then return false end
+  if user and user.uid >= 0 and stat.uid ~= user.uid then return false end
+  if math.floor(stat.mode / 16) % 2 == 1 or math.floor(stat.mode / 2) % 2 == 1 then return false end
+  privateDirs[env] = dir
+  return dir
+end
+
+-- Write a file under a temporary name and rename it into place, so readers
+-- never see it half written.
+local function writeAtomic(path, data)
+  local temp = path .. "." .. uv.os_getpid()
+  local fd = uv.fs_open(temp, "w", 384) -- 0600
+  if not fd then return false end
+  local ok = uv.fs_write(fd, data, 0)
+  uv.fs_close(fd)
+  if ok then ok = uv.fs_rename(temp, path) end
+  if not ok then uv.fs_unlink(temp) end
+  return ok
+end
+
+-- Drop the copies of other versions of a native library from its cache,
+-- named "<crc>-<size>-<name>" by bundle.action.
+local function removeOtherVersions(dir, keep, name)
+  local req = uv.fs_scandir(dir)
+  if not req then return end
+  for entry in uv.fs_scandir_next, req do
+    local path = pathJoin(dir, entry)
+    if entry:match("^%x+%-%d+%-(.*)$") == name and path ~= keep then
+      uv.fs_unlink(path)
+    end
+  end
+end
+
+-- Lua files loaded from folders are compiled once and kept as bytecode in
+-- LUVI_BYTECODE_CACHE (a private folder under tmpBase by default). Each file
+-- has one slot, headed by the engine, luvi version, chunk name and the size
+-- and mtime of the source it was compiled from.
+local engine = jit and jit.version or _VERSION
+local function getBytecodeDir()
+  return getPrivateDir("LUVI_BYTECODE_CACHE", "luvi-bytecode-")
+end
+
+local function bytecodeHeader(chunkname, file, stat)
+  return string.format("%s\t%s\t%s\t%d\t%d.%09d\t%s\n", engine, luvi.version, chunkname,
+    stat.size, stat.mtime.sec, stat.mtime.nsec or 0, file)
+end
+
+-- Remove slots compiled by other versions or from sources that changed or
+-- are gone. Runs at most once a day, the first time something is stored.
+local swept = false
+local function sweepBytecode(dir)
+  swept = true
+  local marker = pathJoin(dir, "swept")
+  local stat = uv.fs_stat(marker)
+  local now = os.time()
+  if stat and now - stat.mtime.sec < 86400 then return end
+  local fd = uv.fs_open(marker, "w", 384) -- 0600
+  if fd then uv.fs_close(fd) end
+  local req = uv.fs_scandir(dir)
+  if not req then return end
+  for name in uv.fs_scandir_next, req do
+    local slot = pathJoin(dir, name)
+    if name:match("%.luac$") then
+      local head = readAll(slot, 4096)
+      local line = head and head:match("^[^\n]*\n")
+      local fields = {}
+      for field in (line or ""):gmatch("[^\t\n]+") do
+        fields[#fields + 1] = field
+      end
+      local source = #fields == 6 and uv.fs_stat(fields[6])
+      if not source or bytecodeHeader(fields[3], fields[6], source) ~= line then
+        uv.fs_unlink(slot)
+      end
+    elseif name:match("%.luac%.%d+$") then
+      -- Left behind by a process that died while storing
+      uv.fs_unlink(slot)
+    end
+  end
+end
+
+local function storeBytecode(dir, slot, data)
+  writeAtomic(slot, data)
+  if not swept then sweepBytecode(dir) end
+end
+
+-- LUVI_BUNDLE_CACHE=bytes keeps what folder bundles stat, list and read in
+-- memory, up to that many bytes of file contents, until a watch on the
+-- directories involved reports a change. Files in directories that can't be
+-- watched are kept too, but checked with a stat before they are reused.
+local folderCacheLimit = tonumber(getenv("LUVI_BUNDLE_CACHE") or "") or 0
+
 -- Bundle from folder on disk
 local function folderBundle(base)
   local bundle = { base = base }
+  local caching = folderCacheLimit > 0
 
-  function bundle.stat(path)
-    path = pathJoin(base, "./" .. path)
-    local raw, err = uv.fs_stat(path)
+  -- Stats (false for missing paths), listings and contents, keyed by the
+  -- path as given. Contents are evicted oldest first past the limit.
+  local stats, misses, listings, contents, order, first, last, cached
+  local function invalidate()
+    stats, misses, listings, contents, order, first, last, cached = {}, {}, {}, {}, {}, 1, 0, 0
+  end
+  invalidate()
+
+  local function statPath(path)
+    local raw, err = uv.fs_stat(pathJoin(base, "./" .. path))
     if not raw then return nil, err end
     return {
       type = string.lower(raw.type),
@@ -25,36 +153,227 @@ local function folderBundle(base)
     }
   end
 
-  function bundle.readdir(path)
-    path = pathJoin(base, "./" .. path)
-    local req, err = uv.fs_scandir(path)
-    if not req then
-      return nil, err
+  function bundle.stat(path)
+    local stat = stats[path]
+    if stat == nil then
+      local err
+      stat, err = statPath(path)
+      if not (caching and bundle.watch(path, invalidate)) then
+        return stat, err
+      end
+      stats[path] = stat or false
+      misses[path] = err
     end
+    if not stat then return nil, misses[path] end
+    -- Callers get their own copy of cached stats
+    return { type = stat.type, size = stat.size, mtime = stat.mtime }
+  end
 
-    local files = {}
-    repeat
-      local name = uv.fs_scandir_next(req)
-      if name then
-        files[#files + 1] = name
+  function bundle.readdir(path)
+    local files = listings[path]
+    if not files then
+      local req, err = uv.fs_scandir(pathJoin(base, "./" .. path))
+      if not req then
+        return nil, err
       end
-    until not name
-    return files
+
+      files = {}
+      repeat
+        local name = uv.fs_scandir_next(req)
+        if name then
+          files[#files + 1] = name
+        end
+      until not name
+      if not (caching and bundle.watch(path, invalidate, true)) then
+        return files
+      end
+      listings[path] = files
+    end
+    local copy = {}
+    for i = 1, #files do
+      copy[i] = files[i]
+    end
+    return copy
+  end
+
+  local function forget(path)
+    local entry = contents[path]
+    if entry then
+      contents[path] = nil
+      cached = cached - #entry.data
+    end
   end
 
+  -- Each entry knows its slot in order, so the stale slot a path leaves
+  -- behind when it's remembered again doesn't evict the new entry.
+  local function remember(path, data, stat, verify)
+    if #data > folderCacheLimit / 8 then return end
+    forget(path)
+    last = last + 1
+    local slot = last
+    contents[path] = { data = data, stat = stat, verify = verify, slot = slot }
+    order[slot] = path
+    cached = cached + #data
+    while cached > folderCacheLimit do
+      local oldest = order[first]
+      local entry = contents[oldest]
+      if entry and entry.slot == first then forget(oldest) end
+      order[first] = nil
+      first = first + 1
+    end
+  end
+
+  -- Read with luvi.readfile: open, fstat, read and close, with no separate
+  -- stat or pathJoin once a file is cached.
   function bundle.readfile(path)
-    path = pathJoin(base, "./" .. path)
-    local fd, stat, data, err
-    stat, err = uv.fs_stat(path)
+    local entry = contents[path]
+    if entry then
+      if not entry.verify then return entry.data end
+      local stat = statPath(path)
+      if stat and stat.size == entry.stat.size and
+         stat.mtime.sec == entry.stat.mtime.sec and stat.mtime.nsec == entry.stat.mtime.nsec then
+        return entry.data
+      end
+      forget(path)
+    end
+    local data, stat = luvi.readfile(pathJoin(base, "./" .. path))
+    if not data then
+      -- Directories have no contents
+      if type(stat) == "table" then return end
+      return nil, stat
+    end
+    if caching then
+      local watched = bundle.watch(path, invalidate)
+      if watched then stats[path] = stat end
+      remember(path, data, stat, not watched)
+    end
+    return data
+  end
+
+  -- Compile a Lua file, reusing its bytecode from the last time it was
+  -- compiled when it hasn't changed since.
+  function bundle.load(path, chunkname)
+    local stat, err = bundle.stat(path)
+    if not stat then return nil, err end
+    local file = pathJoin(base, "./" .. path)
+    if stat.type ~= "file" then return nil, file .. " is not a file" end
+    local dir = getBytecodeDir()
+    local header, slot
+    if dir then
+      header = bytecodeHeader(chunkname, file, stat)
+      slot = pathJoin(dir, string.format("%08x.luac", miniz.crc32(0, chunkname .. "\t" .. file)))
+      local cached = luvi.readfile(slot)
+      if cached and cached:sub(1, #header) == header then
+        local fn = loadstring(cached:sub(#header + 1), chunkname)
+        if fn then return fn end
+      end
+    end
+    local source
+    source, err = bundle.readfile(path)
+    if not source then return nil, err end
+    local fn
+    fn, err = loadstring(source, chunkname)
+    if fn and dir then
+      storeBytecode(dir, slot, header .. string.dump(fn))
+    end
+    return fn, err
+  end
+
+  function bundle.open(path)
+    local stat, err = bundle.stat(path)
     if not stat then return nil, err end
     if stat.type ~= "file" then return end
-    fd, err = uv.fs_open(path, "r", 0644)
+    local fd
+    fd, err = uv.fs_open(pathJoin(base, "./" .. path), "r", 0644)
     if not fd then return nil, err end
-    if stat then
-      data, err = uv.fs_read(fd, stat.size, 0)
+    local offset = 0
+    local stream = {}
+    function stream.read(size)
+      if not fd then return end
+      local chunk, err = uv.fs_read(fd, size or 65536, offset)
+      if not chunk or #chunk == 0 then
+        stream.close()
+        return nil, err
+      end
+      offset = offset + #chunk
+      return chunk
     end
-    uv.fs_close(fd)
-    return data, err
+    function stream.size()
+      return stat.size
+    end
+    function stream.close()
+      if fd then
+        uv.fs_close(fd)
+        fd = nil
+      end
+    end
+    return stream
+  end
+
+  -- Files on disk are served as they are, like stored zip entries. Their
+  -- crc32 is only known when the data is read.
+  function bundle.raw(path, withData)
+    local stat, err = bundle.stat(path)
+    if not stat then return nil, err end
+    if stat.type ~= "file" then return end
+    local raw = {
+      method = 0,
+      size = stat.size,
+      comp_size = stat.size,
+      file = pathJoin(base, "./" .. path),
+      offset = 0,
+      length = stat.size,
+    }
+    if withData ~= false then
+      local data
+      data, err = bundle.readfile(path)
+      if not data then return nil, err end
+      raw.data = data
+      raw.crc32 = miniz.crc32(0, data)
+      raw.size, raw.comp_size, raw.length = #data, #data, #data
+    end
+    return raw
+  end
+
+  -- Directories are watched one by one, recursive watches aren't available
+  -- everywhere. The handles are unref'd so they don't keep the app running.
+  local watchers, listeners = {}, {}
+  local function changed()
+    for listener in pairs(listeners) do
+      listener()
+    end
+  end
+  local function watchDir(dir)
+    if watchers[dir] then return true end
+    local handle = uv.new_fs_event()
+    if not handle then return false end
+    if not uv.fs_event_start(handle, dir, {}, changed) then
+      uv.close(handle)
+      return false
+    end
+    uv.unref(handle)
+    watchers[dir] = handle
+    return true
+  end
+
+  -- Call onChange whenever a directory that path is looked up through
+  -- changes, including path itself when isDir is set. Returns false when
+  -- that can't be watched, in which case nothing about path should be cached.
+  function bundle.watch(path, onChange, isDir)
+    listeners[onChange] = true
+    local parts = {}
+    for part in pathJoin("", "./" .. path):gmatch("[^/\\]+") do
+      parts[#parts + 1] = part
+    end
+    local dir = base
+    for i = 0, isDir and #parts or #parts - 1 do
+      if i > 0 then dir = pathJoin(dir, parts[i]) end
+      if not watchDir(dir) then
+        -- A missing directory is covered by the watch on its parent
+        return i > 0 and not uv.fs_stat(dir)
+      end
+    end
+    return true
   end
 
   return bundle
@@ -74,95 +393,321 @@ local function chrootBundle(bundle, prefix)
   function bundle.readfile(path)
     return bundleReadfile(prefix .. path)
   end
+  local bundleOpen = bundle.open
+  function bundle.open(path)
+    return bundleOpen(prefix .. path)
+  end
+  local bundleRaw = bundle.raw
+  function bundle.raw(path, withData)
+    return bundleRaw(prefix .. path, withData)
+  end
+  local bundleModulePath = bundle.modulePath
+  if bundleModulePath then
+    function bundle.modulePath(name)
+      local path = bundleModulePath(name)
+      if path and path:sub(1, #prefix) == prefix then
+        return path:sub(#prefix + 1)
+      end
+    end
+  end
 end
 
+-- Where buildBundle stores the module map, hidden names are never bundled
+local moduleMapPath = ".luvi/modules"
+
 -- Use a zip file as a bundle
+-- Paths are resolved through the reader's directory index, so stat, readdir
+-- and readfile never scan the central directory.
 local function zipBundle(base, zip)
   local bundle = { base = base }
 
   function bundle.stat(path)
-    path = pathJoin("./" .. path)
-    if path == "" then
-      return {
-        type = "directory",
-        size = 0,
-        mtime = 0
-      }
-    end
-    local err
-    local index = zip:locate_file(path)
-    if not index then
-      index, err = zip:locate_file(path .. "/")
-      if not index then return nil, err end
-    end
-    local raw = zip:stat(index)
-
-    return {
-      type = raw.filename:sub(-1) == "/" and "directory" or "file",
-      size = raw.uncomp_size,
-      mtime = raw.time,
-    }
+    return zip:stat_path(path)
   end
 
   function bundle.readdir(path)
-    path = pathJoin("./" .. path)
-    local index, err
-    if path == "" then
-      index = 0
-    else
-      path = path .. "/"
-      index, err = zip:locate_file(path )
-      if not index then return nil, err end
-      if not zip:is_directory(index) then
-        return nil, path .. " is not a directory"
-      end
-    end
-    local files = {}
-    for i = index + 1, zip:get_num_files() do
-      local filename = zip:get_filename(i)
-      if string.sub(filename, 1, #path) ~= path then break end
-      filename = filename:sub(#path + 1)
-      local n = string.find(filename, "/")
-      if n == #filename then
-        filename = string.sub(filename, 1, #filename - 1)
-        n = nil
-      end
-      if not n then
-        files[#files + 1] = filename
-      end
-    end
-    return files
+    return zip:readdir(path)
   end
 
   function bundle.readfile(path)
-    path = pathJoin("./" .. path)
-    local index, err = zip:locate_file(path)
+    local index, err = zip:locate(path)
     if not index then return nil, err end
+    if zip:is_directory(index) then return end
     return zip:extract(index)
   end
 
+  function bundle.open(path)
+    local index, err = zip:locate(path)
+    if not index then return nil, err end
+    if zip:is_directory(index) then return end
+    local entry
+    entry, err = zip:open_stream(index)
+    if not entry then return nil, err end
+    return {
+      read = function (size) return entry:read(size) end,
+      size = function () return entry:size() end,
+      close = function () return entry:close() end,
+    }
+  end
+
+  -- Compressed bytes of an entry, see reader:raw. file is the path to pass
+  -- with offset/length to uv.fs_sendfile.
+  function bundle.raw(path, withData)
+    local index, err = zip:locate(path)
+    if not index then return nil, err end
+    if zip:is_directory(index) then return end
+    local raw
+    raw, err = zip:raw(index, withData)
+    if not raw then return nil, err end
+    raw.file = base
+    return raw
+  end
+
+  -- Entries a startup manifest marked hot are stored at the front of the
+  -- zip (see buildBundle), read them ahead in one go.
+  local hotEnd
+  for i = 1, zip:get_num_files() do
+    local stat = zip:stat(i)
+    if not (stat and stat.comment:match("^luvi %d+c?s?h ")) then break end
+    local raw = zip:raw(i, false)
+    if raw then hotEnd = raw.offset + raw.length end
+  end
+  if hotEnd then
+    local start = zip:get_offset()
+    zip:prefetch(start, hotEnd - start)
+  end
+
+  -- The Lua file the map buildBundle wrote gives for a module name, so
+  -- require of a bundled module is a lookup in the map and in the reader's
+  -- path index.
+  local modules
+  function bundle.modulePath(name)
+    if modules == nil then
+      modules = false
+      local index = zip:locate(moduleMapPath)
+      local map = index and zip:extract(index)
+      if map then
+        modules = {}
+        for module, path in map:gmatch("([^\t\n]+)\t([^\n]+)\n") do
+          modules[module] = path
+        end
+      end
+    end
+    local path = modules and modules[name]
+    if path and zip:locate(path) then return path end
+  end
+
   -- Support zips with a single folder inserted at top-level
   local entries = bundle.readdir("")
-  if entries and #entries == 1 and bundle.stat(entries[1]).type == "directory" then
-    chrootBundle(bundle, entries[1] .. '/')
+  if entries then
+    local visible = {}
+    for i = 1, #entries do
+      if entries[i]:sub(1, 1) ~= "." then visible[#visible + 1] = entries[i] end
+    end
+    if #visible == 1 and bundle.stat(visible[1]).type == "directory" then
+      chrootBundle(bundle, visible[1] .. '/')
+    end
   end
 
   return bundle
 end
 
+-- Translate a glob into a lua pattern. "*" and "?" stay within a path
+-- segment, "**" also matches across segments.
+local function globPattern(glob)
+  local pattern = glob:gsub("[%^%$%(%)%%%.%[%]%+%-]", "%%%0")
+  pattern = pattern:gsub("%*%*", "\1"):gsub("%*", "[^/]*"):gsub("\1", ".*"):gsub("%?", "[^/]")
+  return "^" .. pattern .. "$"
+end
+
+-- Build the compression policy for buildBundle. options.level is the default
+-- level for all files (0 stores them), options.rules a list of
+-- { glob, level } overrides where the first matching glob wins. Globs
+-- without a "/" are matched against the file name only.
+local function compressionPolicy(options)
+  local default = tonumber(options.level or 9)
+  if not default or default < 0 or default > 9 then
+    error("Invalid compression level: " .. tostring(options.level))
+  end
+  local rules = {}
+  for i, rule in ipairs(options.rules or {}) do
+    local glob, level = rule[1], tonumber(rule[2])
+    if not level or level < 0 or level > 9 then
+      error("Invalid compression level for " .. tostring(glob) .. ": " .. tostring(rule[2]))
+    end
+    rules[i] = {
+      pattern = globPattern(glob),
+      base = not glob:find("/", 1, true),
+      level = level,
+    }
+  end
+  return function (path, name)
+    for i = 1, #rules do
+      local rule = rules[i]
+      if (rule.base and name or path):match(rule.pattern) then
+        return rule.level
+      end
+    end
+    return default
+  end
+end
+
+-- Read, compile and compress one file for buildBundle. Runs on the
+-- threadpool through uv.new_work, so it can't use upvalues, and luv passes
+-- at most 9 arguments each way. flags holds "c" to compile, "s" to strip and
+-- "f" to force. Files are read from source, "offset:length:file", unless
+-- their data is passed in. When the crc of the source matches prevCrc the
+-- previous build's entry is reused and only true is returned in place of the
+-- data.
+local function prepareEntry(index, path, level, flags, source, data, prevCrc)
+  local uv = require('uv')
+  local miniz = require('miniz')
+  local start = uv.hrtime()
+  local err
+  if not data then
+    local offset, length, file = source:match("^(%d+):(%d+):(.*)$")
+    local fd
+    fd, err = uv.fs_open(file, "r", 0)
+    if not fd then return index, nil, err end
+    data, err = uv.fs_read(fd, tonumber(length), tonumber(offset))
+    uv.fs_close(fd)
+    if not data then return index, nil, err end
+  end
+  local read = uv.hrtime()
+  local sourceCrc = miniz.crc32(0, data)
+  if sourceCrc == prevCrc then
+    return index, true, nil, nil, nil, read - start, 0, 0, sourceCrc
+  end
+  if flags:find("c", 1, true) then
+    local fn
+    fn, err = (loadstring or load)(data, '@' .. path)
+    if fn then
+      data = string.dump(fn, flags:find("s", 1, true) ~= nil)
+    elseif not flags:find("f", 1, true) then
+      return index, nil, err
+    end
+  end
+  local compiled = uv.hrtime()
+  local compressed, method, crc = miniz.zip_compress(data, level)
+  return index, compressed, method, crc, #data,
+    read - start, compiled - read, uv.hrtime() - compiled, sourceCrc
+end
+
+-- Entries written by buildBundle carry a comment identifying their source and
+-- build settings, which lets the next build reuse them.
+local function sourceKey(level, compile, strip, hot, stat)
+  local mtime = stat.mtime
+  if type(mtime) == "table" then
+    mtime = mtime.sec .. "." .. mtime.nsec
+  end
+  return string.format("luvi %d%s%s%s %d %s", level, compile and "c" or "",
+    compile and strip and "s" or "", hot and "h" or "", stat.size, tostring(mtime))
+end
+
+-- Read a startup manifest written by a run with LUVI_STARTUP_MANIFEST set,
+-- one bundle path per line, in the order they were first read.
+local function readManifest(path)
+  local fd = assert(uv.fs_open(path, "r", 384))
+  local stat = uv.fs_fstat(fd)
+  local data = assert(uv.fs_read(fd, stat.size, 0))
+  uv.fs_close(fd)
+  local hot, rank = {}, 0
+  for line in data:gmatch("[^\r\n]+") do
+    if not hot[line] then
+      rank = rank + 1
+      hot[line] = rank
+    end
+  end
+  return hot
+end
+
+-- Index the entries of the previous build by path.
+local function previousEntries(reader)
+  local entries = {}
+  for i = 1, reader:get_num_files() do
+    local stat = reader:stat(i)
+    local key, crc
+    if stat then
+      key, crc = stat.comment:match("^(luvi %S+ %d+ %S+) (%x+)$")
+    end
+    if key then
+      entries[stat.filename] = { index = i, key = key, crc = tonumber(crc, 16) }
+    end
+  end
+  return entries
+end
+
+-- Map module names to the Lua files in entries, the way luvit's require
+-- finds them from main.lua: deps/ first, then libs/, then the top level,
+-- with x.lua before x/init.lua. Names use "/" and, where that's free, ".".
+-- Returns the map as "name\tpath" lines.
+local function moduleMap(entries)
+  local roots = { "deps/", "libs/" }
+  local best = {}
+  for _, entry in ipairs(entries) do
+    local path = entry.path
+    if path:match("%.lua$") then
+      local rank, rel = 3, path:sub(1, -5)
+      for i, root in ipairs(roots) do
+        if path:sub(1, #root) == root then
+          rank, rel = i, rel:sub(#root + 1)
+          break
+        end
+      end
+      local init = rel:match("^(.*)/init$")
+      if init then rel, rank = init, rank + 0.5 end
+      -- Nested deps belong to the package holding them
+      if rel ~= "init" and not rel:match("/deps/") and not rel:match("/libs/") and
+         not (best[rel] and best[rel].rank <= rank) then
+        best[rel] = { rank = rank, path = path }
+      end
+    end
+  end
+  local names = {}
+  for name in pairs(best) do
+    names[#names + 1] = name
+  end
+  for i = 1, #names do
+    local name = names[i]
+    local dotted = name:gsub("/", ".")
+    if not best[dotted] then
+      names[#names + 1] = dotted
+      best[dotted] = best[name]
+    end
+  end
+  table.sort(names)
+  local lines = {}
+  for i, name in ipairs(names) do
+    lines[i] = name .. "\t" .. best[name].path .. "\n"
+  end
+  return table.concat(lines)
+end
+
 local function buildBundle(options, bundle)
   assert(type(options)=='table')
   local target = assert(options.output, "missing output target")
   target = pathJoin(uv.cwd(), target)
   print("Creating new binary: " .. target)
-  local fd = assert(uv.fs_open(target, "w", 511)) -- 0777
+  -- Entries of the previous build are reused when their source is unchanged,
+  -- so the new binary is written next to it and renamed over it at the end.
+  local previous, prevEntries
+  if not options.clean then
+    previous = miniz.new_reader(target)
+    prevEntries = previous and previousEntries(previous)
+  end
+  local output = target .. ".new"
+  -- Opened for reading too, the zip's tail is read back to finish it
+  local fd = assert(uv.fs_open(output, "w+", 511)) -- 0777
   local binSize
   do
     local source = uv.exepath()
 
-    local reader = miniz.new_reader(source)
-    if reader then
+    local found = miniz.probe(source)
+    local reader = not found and miniz.new_reader(source)
+    if found then
       -- If contains a zip, find where the zip starts
+      binSize = found.offset
+    elseif reader then
       binSize = reader:get_offset()
     else
       -- Otherwise just read the file size
@@ -174,9 +719,28 @@ local function buildBundle(options, bundle)
     uv.fs_close(fd2)
   end
 
-  local load = loadstring or load
-  local writer = miniz.new_writer()
-  local function copyFolder(path)
+  local hrtime = uv.hrtime
+  local started = hrtime()
+  local levelFor = compressionPolicy(options)
+  -- Files from the startup manifest go first and are stored, so a launch can
+  -- prefetch them as one contiguous range and read them without inflating.
+  local hot = options.manifest and readManifest(options.manifest) or {}
+  local compile = options.strip or options.compile
+  -- Every entry gets the same timestamp, so the output only depends on the
+  -- input files.
+  local mtime = tonumber(options.mtime or getenv("SOURCE_DATE_EPOCH")) or os.time()
+  local jobs = tonumber(options.jobs) or #uv.cpu_info()
+  if jobs < 1 then jobs = 1 end
+  -- The threadpool is created on first use with UV_THREADPOOL_SIZE threads.
+  if uv.os_setenv and not getenv("UV_THREADPOOL_SIZE") then
+    uv.os_setenv("UV_THREADPOOL_SIZE", tostring(jobs))
+  end
+
+  -- Walk the bundle into a flat list of entries in zip order. Files that
+  -- are plain bytes on disk (folders, stored zip entries) are read by the
+  -- workers, anything else is read here.
+  local entries = {}
+  local function walk(path)
     local files = bundle.readdir(path)
     if not files then return end
     for i = 1, #files do
@@ -185,35 +749,198 @@ local function buildBundle(options, bundle)
         local child = pathJoin(path, name)
         local stat = bundle.stat(child)
         if stat.type == "directory" then
-          writer:add(child .. "/", "")
-          copyFolder(child)
+          entries[#entries + 1] = { path = child .. "/" }
+          walk(child)
         elseif stat.type == "file" then
-          print("    " .. child)
-          local ctx = bundle.readfile(child)
-          local isLua = name:sub(-4, -1):lower() == ".lua"
-          local compile = options.strip or options.compile
-
-          if compile and isLua and name:lower() ~= 'package.lua' then
-            local fn, err = load(ctx, '@' .. child)
-            if fn then
-              ctx = string.dump(fn, options.strip)
-            elseif not options.force then
-              error(err)
-            end
+          local entry = {
+            path = child,
+            level = hot[child] and 0 or levelFor(child, name),
+            compile = compile and name:sub(-4, -1):lower() == ".lua" and name:lower() ~= 'package.lua' or false,
+            hot = hot[child],
+          }
+          entry.key = sourceKey(entry.level, entry.compile, options.strip, entry.hot, stat)
+          local prev = prevEntries and prevEntries[child]
+          if prev and prev.key == entry.key then
+            -- Same size and mtime, no need to even read it
+            entry.reuse = prev.index
+          elseif prev and prev.key:match("^%S+ %S+ %d+") == entry.key:match("^%S+ %S+ %d+") then
+            -- Same size, reused if the content is the same too
+            entry.prev = prev
           end
-
-          writer:add(child, ctx, 9)
+          local raw = not entry.reuse and bundle.raw and bundle.raw(child, false)
+          if entry.reuse then
+            entry.level = nil
+          elseif raw and raw.method == 0 then
+            entry.file, entry.offset, entry.length = raw.file, raw.offset, raw.length
+          else
+            entry.data = bundle.readfile(child)
+          end
+          entries[#entries + 1] = entry
         end
       end
     end
   end
   print("Zipping " .. bundle.base)
-  copyFolder("")
-  print("Writing zip file")
-  uv.fs_write(fd, writer:finalize(), binSize)
+  walk("")
+  if next(hot) then
+    -- Stable sort: hot files in manifest order, then everything else as walked
+    for i = 1, #entries do entries[i].order = i end
+    table.sort(entries, function (a, b)
+      if a.hot or b.hot then
+        return (a.hot or math.huge) < (b.hot or math.huge)
+      end
+      return a.order < b.order
+    end)
+  end
+  local walked = hrtime()
+
+  -- Prepare files on the threadpool and append them as soon as all entries
+  -- before them are done, so the zip is the same whatever the number of jobs.
+  -- At most jobs * 4 entries are in flight or waiting to be appended, and
+  -- appended entries go straight to the file after the binary.
+  local writer = miniz.new_file_writer(fd, binSize)
+  local results = {}
+  local nextIndex, queued, pending = 1, 0, 0
+  local failure
+  local times = { read = 0, compile = 0, compress = 0, write = 0 }
+  local reused, rebuilt = 0, 0
+  -- With options.dedup, files with the same content share one copy of the
+  -- data. contents maps a content key to the first entry written with it.
+  local written, deduped, contents = 0, 0, {}
+  local work
+
+  local function append()
+    while results[nextIndex] do
+      local entry = entries[nextIndex]
+      local result = results[nextIndex]
+      results[nextIndex] = nil
+      local before = hrtime()
+      if result == true then
+        writer:add_raw(entry.path, "", 0, 0, 0, mtime)
+        written = written + 1
+      elseif result.reuse then
+        reused = reused + 1
+        -- Entries sharing data in the previous build keep sharing it
+        local key = options.dedup and "@" .. previous:raw(result.reuse, false).offset
+        local comment = result.comment or previous:stat(result.reuse).comment
+        if key and contents[key] then
+          deduped = deduped + 1
+          writer:add_alias(entry.path, contents[key].index, comment)
+        elseif result.comment then
+          -- Reused by its crc: copy the data under a comment with the current
+          -- mtime, so the next build doesn't have to read the file again
+          local raw = assert(previous:raw(result.reuse))
+          writer:add_raw(entry.path, raw.data, raw.method, raw.crc32, raw.size, mtime, comment)
+          written = written + 1
+          if key then contents[key] = { index = written, path = entry.path } end
+        else
+          writer:add_from_zip(previous, result.reuse)
+          written = written + 1
+          if key then contents[key] = { index = written, path = entry.path } end
+        end
+      else
+        rebuilt = rebuilt + 1
+        local comment = string.format("%s %08x", entry.key, result.sourceCrc)
+        local key = options.dedup and string.format("%d %08x %d %08x %d", result.method,
+          result.crc, result.size, miniz.crc32(0, result.data), #result.data)
+        if key and contents[key] then
+          deduped = deduped + 1
+          print("    " .. entry.path .. " (same as " .. contents[key].path .. ")")
+          writer:add_alias(entry.path, contents[key].index, comment)
+        else
+          print("    " .. entry.path .. (entry.hot and " (hot)" or result.method == 0 and " (stored)" or ""))
+          writer:add_raw(entry.path, result.data, result.method, result.crc, result.size, mtime, comment)
+          written = written + 1
+          if key then contents[key] = { index = written, path = entry.path } end
+        end
+      end
+      times.write = times.write + hrtime() - before
+      nextIndex = nextIndex + 1
+    end
+  end
+
+  local function schedule()
+    append()
+    while not failure and queued < #entries and queued - nextIndex < jobs * 4 do
+      queued = queued + 1
+      local entry = entries[queued]
+      if entry.level then
+        pending = pending + 1
+        local flags = (entry.compile and "c" or "") .. (options.strip and "s" or "") ..
+          (options.force and "f" or "")
+        local source = entry.file and string.format("%d:%d:%s", entry.offset, entry.length, entry.file)
+        work:queue(queued, entry.path, entry.level, flags, source or false, entry.data or false,
+          entry.prev and entry.prev.crc or false)
+        entry.data = nil
+      elseif entry.reuse then
+        results[queued] = { reuse = entry.reuse }
+        append()
+      else
+        results[queued] = true
+        append()
+      end
+    end
+  end
+
+  work = uv.new_work(prepareEntry, function (index, data, method, crc, size, read, compiled, compressed, sourceCrc)
+    pending = pending - 1
+    if not data then
+      failure = failure or (entries[index].path .. ": " .. tostring(method))
+      return
+    end
+    if data == true then
+      local entry = entries[index]
+      results[index] = {
+        reuse = entry.prev.index,
+        comment = string.format("%s %08x", entry.key, sourceCrc),
+      }
+    else
+      results[index] = { data = data, method = method, crc = crc, size = size, sourceCrc = sourceCrc }
+    end
+    times.read = times.read + read
+    times.compile = times.compile + compiled
+    times.compress = times.compress + compressed
+    schedule()
+  end)
+
+  schedule()
+  while pending > 0 do
+    uv.run("once")
+  end
+  if failure then
+    uv.fs_close(fd)
+    uv.fs_unlink(output)
+    error(failure)
+  end
+
+  -- Lets require find bundled modules without probing paths
+  local map = moduleMap(entries)
+  if #map > 0 then
+    writer:add_raw(moduleMapPath, map, 0, 0, #map, mtime)
+  end
+
+  print("Writing zip central directory")
+  local before = hrtime()
+  local zipSize = writer:finalize()
+  -- Let the runtime find the zip without searching for it
+  local _, hash = miniz.append_trailer(fd, binSize, zipSize)
   uv.fs_close(fd)
-  print("Done building " .. target)
-  return
+  -- Let go of the previous build before replacing it
+  writer, previous = nil, nil
+  collectgarbage()
+  assert(uv.fs_rename(output, target))
+  times.write = times.write + hrtime() - before
+  local function ms(ns) return string.format("%.1fms", ns / 1e6) end
+  print(string.format("Timings (%d files, %d jobs): walk %s, read %s, compile %s, compress %s, write %s, total %s",
+    #entries, jobs, ms(walked - started), ms(times.read), ms(times.compile),
+    ms(times.compress), ms(times.write), ms(hrtime() - started)))
+  print("  read, compile and compress are summed over all jobs")
+  print(string.format("Reused %d unchanged files from the previous build, rebuilt %d", reused, rebuilt))
+  if options.dedup then
+    print(string.format("Deduplicated %d files with the same content as others", deduped))
+  end
+  print(string.format("Done building %s (hash %08x)", target, hash))
+  return { reused = reused, rebuilt = rebuilt, deduped = deduped }
 end
 
 -- Given a list of bundles, merge them into a single VFS.  Lower indexed items
@@ -225,22 +952,64 @@ local function combinedBundle(bundles)
   end
   local bundle = { base = table.concat(bases, ";") }
 
-  function bundle.stat(path)
-    local err
+  -- The layer each path resolves to, or false with the error for paths no
+  -- layer has, and the merged listing of each directory. Reading a file looks
+  -- for a regular file through the layers, past directories of the same name
+  -- in upper layers, so it is resolved separately. Zip layers never change,
+  -- folder layers are watched and clear it all when they do.
+  local owners, fileOwners, misses, fileMisses, listings = {}, {}, {}, {}, {}
+  local function invalidate()
+    owners, fileOwners, misses, fileMisses, listings = {}, {}, {}, {}, {}
+  end
+
+  local function resolve(path, fileOnly)
+    local key = pathJoin("", "./" .. path)
+    local owner
+    if fileOnly then
+      owner = fileOwners[key]
+      if owner ~= nil then return owner, fileMisses[key] end
+    else
+      owner = owners[key]
+      if owner ~= nil then return owner, misses[key] end
+    end
+    local cacheable, err = true
     for i = 1, #bundles do
+      local layer = bundles[i]
+      if layer.watch and not layer.watch(key, invalidate) then
+        cacheable = false
+      end
       local stat
-      stat, err = bundles[i].stat(path)
-      if stat then return stat end
+      stat, err = layer.stat(key)
+      if stat and (stat.type == "file" or not fileOnly) then
+        owner = i
+        break
+      end
+    end
+    if cacheable and fileOnly then
+      fileOwners[key], fileMisses[key] = owner or false, err
+    elseif cacheable then
+      owners[key], misses[key] = owner or false, err
     end
-    return nil, err
+    return owner, err
   end
 
-  function bundle.readdir(path)
+  function bundle.stat(path)
+    local i, err = resolve(path)
+    if not i then return nil, err end
+    return bundles[i].stat(path)
+  end
+
+  local function merge(key)
     local has = {}
     local files, err
+    local cacheable = true
     for i = 1, #bundles do
+      local layer = bundles[i]
+      if layer.watch and not layer.watch(key, invalidate, true) then
+        cacheable = false
+      end
       local list
-      list, err = bundles[i].readdir(path)
+      list, err = layer.readdir(key)
       if list then
         for j = 1, #list do
           local name = list[j]
@@ -257,21 +1026,65 @@ local function combinedBundle(bundles)
         end
       end
     end
-    if files then
-      return files
-    else
-      return nil, err
+    return files, err, cacheable
+  end
+
+  function bundle.readdir(path)
+    local key = pathJoin("", "./" .. path)
+    local listing = listings[key]
+    if not listing then
+      local files, err, cacheable = merge(key)
+      listing = { files = files, err = err }
+      if cacheable then listings[key] = listing end
+    end
+    if not listing.files then
+      return nil, listing.err
     end
+    -- Callers may sort or change the list they get
+    local files = {}
+    for i = 1, #listing.files do
+      files[i] = listing.files[i]
+    end
+    return files
   end
 
   function bundle.readfile(path)
-    local err
+    local i, err = resolve(path, true)
+    if not i then return nil, err end
+    return bundles[i].readfile(path)
+  end
+
+  function bundle.load(path, chunkname)
+    local i, err = resolve(path, true)
+    if not i then return nil, err end
+    local layer = bundles[i]
+    if layer.load then return layer.load(path, chunkname) end
+    local data
+    data, err = layer.readfile(path)
+    if not data then return nil, err end
+    return loadstring(data, chunkname)
+  end
+
+  function bundle.open(path)
+    local i, err = resolve(path, true)
+    if not i then return nil, err end
+    return bundles[i].open(path)
+  end
+
+  function bundle.raw(path, withData)
+    local i, err = resolve(path, true)
+    if not i then return nil, err end
+    return bundles[i].raw(path, withData)
+  end
+
+  -- Ask the module map of each layer in order. The path then resolves like
+  -- any other, so an upper layer's file of the same name is the one loaded.
+  function bundle.modulePath(name)
     for i = 1, #bundles do
-      local data
-      data, err = bundles[i].readfile(path)
-      if data then return data end
+      local modulePath = bundles[i].modulePath
+      local path = modulePath and modulePath(name)
+      if path then return path end
     end
-    return nil, err
   end
 
   return bundle
@@ -283,7 +1096,7 @@ local function makeBundle(bundlePaths)
     local path = pathJoin(uv.cwd(), bundlePaths[n])
     bundlePaths[n] = path
     local bundle
-    local zip = miniz.new_reader(path)
+    local zip = miniz.new_reader(path, 0, "mmap")
     if zip then
       bundle = zipBundle(path, zip)
     else
@@ -301,6 +1114,58 @@ local function makeBundle(bundlePaths)
   return combinedBundle(parts)
 end
 
+-- Record the files read from bundle during the first window ms into a
+-- manifest for buildBundle. The manifest is written when main returns, in
+-- case the process exits right after, and again when the window ends.
+local function recordStartup(bundle, path, window)
+  local start = uv.hrtime()
+  local seen, order = {}, {}
+  local recording = true
+  local function flush()
+    local fd = assert(uv.fs_open(path, "w", 420)) -- 0644
+    uv.fs_write(fd, table.concat(order, "\n") .. "\n", 0)
+    uv.fs_close(fd)
+  end
+  local function record(file)
+    if recording and uv.hrtime() - start <= window * 1e6 then
+      file = pathJoin("", "./" .. file)
+      if not seen[file] then
+        seen[file] = true
+        order[#order + 1] = file
+      end
+    end
+  end
+  local readfile = bundle.readfile
+  function bundle.readfile(file)
+    local data, err = readfile(file)
+    if data then record(file) end
+    return data, err
+  end
+  local load = bundle.load
+  if load then
+    function bundle.load(file, chunkname)
+      local fn, err = load(file, chunkname)
+      if fn then record(file) end
+      return fn, err
+    end
+  end
+  local timer = uv.new_timer()
+  timer:start(window, 0, function ()
+    timer:close()
+    recording = false
+    flush()
+  end)
+  timer:unref()
+  return function ()
+    if recording then flush() end
+  end
+end
+
+local function finish(done, ...)
+  done()
+  return ...
+end
+
 local function commonBundle(bundlePaths, mainPath, args)
 
   mainPath = mainPath or "main.lua"
@@ -311,32 +1176,113 @@ local function commonBundle(bundlePaths, mainPath, args)
   bundle.paths = bundlePaths
   bundle.mainPath = mainPath
 
+  -- LUVI_STARTUP_MANIFEST=path records the files read in the first
+  -- LUVI_STARTUP_MS (default 1000) ms, see buildBundle's manifest option.
+  local startupDone = function () end
+  local manifestPath = getenv("LUVI_STARTUP_MANIFEST")
+  if manifestPath then
+    startupDone = recordStartup(bundle, manifestPath, tonumber(getenv("LUVI_STARTUP_MS")) or 1000)
+  end
+
+  local memfds = {}
   function bundle.action(path, action, ...)
     -- If it's a real path, run it directly.
-    if uv.fs_access(path, "r") then return action(path) end
+    if uv.fs_access(path, "r") then return action(path, ...) end
+    local name = path:match("[^/\\]+$")
+    local data, err
+    -- On Linux, hand the file over in memory
+    if luvi.memfd then
+      local memPath = memfds[path]
+      if memPath then return action(memPath, ...) end
+      data, err = bundle.readfile(path)
+      if not data then return nil, err end
+      memPath = luvi.memfd(name, data)
+      if memPath then
+        -- The descriptor stays open so its path keeps naming this file, as
+        -- package.loadlib caches libraries by path.
+        memfds[path] = memPath
+        return action(memPath, ...)
+      end
+    end
+    -- Otherwise keep one extracted copy per content. Zip entries know their
+    -- crc, so a copy that's there already is used without extracting. Only
+    -- the crc and size are needed, folder files are read when there's none.
+    local cacheDir = getPrivateDir("LUVI_NATIVE_CACHE", "luvi-native-")
+    if cacheDir then
+      local raw = bundle.raw(path, false)
+      local crc, size
+      if raw and raw.crc32 then
+        crc, size = raw.crc32, raw.size
+      else
+        if not data then
+          data, err = bundle.readfile(path)
+          if not data then return nil, err end
+        end
+        crc, size = miniz.crc32(0, data), #data
+      end
+      local cachedPath = pathJoin(cacheDir, string.format("%08x-%d-%s", crc, size, name))
+      local stat = uv.fs_stat(cachedPath)
+      if stat and stat.size == size then return action(cachedPath, ...) end
+      if not data then
+        data, err = bundle.readfile(path)
+        if not data then return nil, err end
+      end
+      if writeAtomic(cachedPath, data) then
+        removeOtherVersions(cacheDir, cachedPath, name)
+        return action(cachedPath, ...)
+      end
+    end
+    if not data then
+      data, err = bundle.readfile(path)
+      if not data then return nil, err end
+    end
     -- Otherwise, copy to a temporary folder and run from there
-    local data, err = bundle.readfile(path)
-    if not data then return nil, err end
     local dir = assert(uv.fs_mkdtemp(pathJoin(tmpBase, "lib-XXXXXX")))
     path = pathJoin(dir, path:match("[^/\\]+$"))
     local fd = uv.fs_open(path, "w", 384) -- 0600
     uv.fs_write(fd, data, 0)
     uv.fs_close(fd)
-    local success, ret = pcall(action, path, ...)
-    uv.fs_unlink(path)
-    uv.fs_rmdir(dir)
-    assert(success, ret)
-    return ret
+    local function cleanup(success, ...)
+      uv.fs_unlink(path)
+      uv.fs_rmdir(dir)
+      assert(success, (...))
+      return ...
+    end
+    return cleanup(pcall(action, path, ...))
+  end
+
+  -- Folder bundles compile through the bytecode cache
+  local function loadBundled(path)
+    local chunkname = "@bundle:" .. path
+    if bundle.load then return bundle.load(path, chunkname) end
+    local lua, err = bundle.readfile(path)
+    if not lua then return nil, err end
+    return loadstring(lua, chunkname)
   end
 
   function bundle.register(name, path)
     if not path then path = name + ".lua" end
     package.preload[name] = function (...)
-      local lua = assert(bundle.readfile(path))
-      return assert(loadstring(lua, "@bundle:" .. path))(...)
+      return assert(loadBundled(path))(...)
     end
   end
 
+  -- Bundles built with a module map let require find their modules, right
+  -- after package.path so files on disk keep their precedence. They load
+  -- through bundle.load like any other bundled file, and so are part of
+  -- startup manifests.
+  if bundle.modulePath then
+    table.insert(package.searchers or package.loaders, 3, function (name)
+      local path = bundle.modulePath(name)
+      if not path then
+        return "\n\tno module '" .. name .. "' in the bundle's module map"
+      end
+      return function (...)
+        return assert(loadBundled(path))(...)
+      end, "bundle:" .. path
+    end)
+  end
+
   _G.args = args
 
   -- Auto-register the require system if present
@@ -356,12 +1302,11 @@ local function commonBundle(bundlePaths, mainPath, args)
     return bundle, mainRequire
   end
   if mainRequire then
-    return mainRequire("./" .. mainPath)
+    return finish(startupDone, mainRequire("./" .. mainPath))
   else
-    local main = bundle.readfile(mainPath)
-    if not main then error("Missing " .. mainPath .. " in " .. bundle.base) end
-    local fn = assert(loadstring(main, "@bundle:" .. mainPath))
-    return fn(unpack(args))
+    if not bundle.stat(mainPath) then error("Missing " .. mainPath .. " in " .. bundle.base) end
+    local fn = assert(loadBundled(mainPath))
+    return finish(startupDone, fn(unpack(args)))
   end
 end
 
@@ -49,5 +49,25 @@ LUALIB_API int luaopen_luvi(lua_State *L) {
   lua_pushstring(L, uv_version_string());
   lua_setfield(L, -2, "libuv");
   lua_setfield(L, -2, "options");
+  lua_pushcfunction(L, luvi_vm_pool_stats);
+  lua_setfield(L, -2, "vm_pool_stats");
+  lua_pushcfunction(L, luvi_vm_pool_configure);
+  lua_setfield(L, -2, "vm_pool_configure");
+  lua_pushcfunction(L, luvi_vm_memory);
+  lua_setfield(L, -2, "vm_memory");
+  lua_pushcfunction(L, luvi_vm_memory_list);
+  lua_setfield(L, -2, "vm_memory_list");
+  lua_pushcfunction(L, luvi_vm_memory_limits);
+  lua_setfield(L, -2, "vm_memory_limits");
+  lua_pushcfunction(L, luvi_set_vm_memory_limit);
+  lua_setfield(L, -2, "set_vm_memory_limit");
+  lua_pushcfunction(L, luvi_set_thread_memory_limit);
+  lua_setfield(L, -2, "set_thread_memory_limit");
+  lua_pushcfunction(L, luvi_readfile);
+  lua_setfield(L, -2, "readfile");
+#ifdef LUVI_HAVE_MEMFD
+  lua_pushcfunction(L, luvi_memfd);
+  lua_setfield(L, -2, "memfd");
+#endif
   return 1;
 }
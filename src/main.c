@@ -19,6 +19,10 @@
 #include "luvi.h"
 #include "luv.h"
 #include "lenv.c"
+#include "vmalloc.c"
+#include "vmpool.c"
+#include "readfile.c"
+#include "memfd.c"
 #include "luvi.c"
 
 #include "snapshot.c"
@@ -36,8 +40,8 @@ static int luvi_traceback(lua_State *L) {
   return 1;
 }
 
-static lua_State* vm_acquire(){
-  lua_State*L = luaL_newstate();
+static lua_State* vm_create(){
+  lua_State*L = luvi_newstate();
   if (L == NULL)
     return L;
 
@@ -140,8 +144,49 @@ static lua_State* vm_acquire(){
   return L;
 }
 
+// Runs uv.new_thread and uv.new_work bodies instead of luv's default, which
+// exits the process when one raises. With a thread memory limit a runaway
+// worker fails with "not enough memory" at any point, so an error only ends
+// that body: it goes to stderr and the body returns nothing.
+static int vm_thread_pcall(lua_State* L, int nargs, int nresults, int flags) {
+  int base = lua_gettop(L) - nargs - 1;
+  int errfunc = 0;
+  int status;
+  if (!(flags & LUVF_CALLBACK_NOTRACEBACK)) {
+    lua_pushcfunction(L, luvi_traceback);
+    lua_insert(L, base + 1);
+    errfunc = base + 1;
+  }
+  status = lua_pcall(L, nargs, nresults, errfunc);
+  if (errfunc) lua_remove(L, errfunc);
+  if (status) {
+    if (!(flags & LUVF_CALLBACK_NOERRMSG)) {
+      const char* msg = lua_tostring(L, -1);
+      fprintf(stderr, "Uncaught Error in thread: %s\n", msg ? msg : "(error object is not a string)");
+    }
+    lua_pop(L, 1);
+    return -status;
+  }
+  return nresults == LUA_MULTRET ? lua_gettop(L) - base : nresults;
+}
+
+// Thread VMs handed to luv are recycled through the warm state pool.
+static lua_State* vm_acquire(){
+  lua_State*L = luvi_vmpool_get();
+  if (L == NULL) {
+    L = vm_create();
+    if (L == NULL)
+      return L;
+    luv_set_thread(L, vm_thread_pcall);
+    luvi_vmpool_mark(L);
+  }
+  luvi_alloc_apply_limit(L, 0);
+  return L;
+}
+
 static void vm_release(lua_State*L) {
-  lua_close(L);
+  if (!luvi_vmpool_put(L))
+    luvi_closestate(L);
 }
 
 int main(int argc, char* argv[] ) {
@@ -156,11 +201,12 @@ int main(int argc, char* argv[] ) {
 
   luv_set_thread_cb(vm_acquire, vm_release);
   // Create the lua state.
-  L = vm_acquire();
+  L = vm_create();
   if (L == NULL) {
     fprintf(stderr, "luaL_newstate has failed\n");
     return 1;
   }
+  luvi_alloc_apply_limit(L, 1);
 
   /* push debug function */
   lua_pushcfunction(L, luvi_traceback);
@@ -169,7 +215,8 @@ int main(int argc, char* argv[] ) {
   // Load the init.lua script
   if (luaL_loadstring(L, "return require('init')(...)")) {
     fprintf(stderr, "%s\n", lua_tostring(L, -1));
-    vm_release(L);
+    luvi_closestate(L);
+    luvi_vmpool_drain();
     return -1;
   }
 
@@ -183,7 +230,8 @@ int main(int argc, char* argv[] ) {
   // Start the main script.
   if (lua_pcall(L, 1, 1, errfunc)) {
     fprintf(stderr, "%s\n", lua_tostring(L, -1));
-    vm_release(L);
+    luvi_closestate(L);
+    luvi_vmpool_drain();
     return -1;
   }
 
@@ -192,6 +240,7 @@ int main(int argc, char* argv[] ) {
   if (lua_type(L, -1) == LUA_TNUMBER) {
     res = (int)lua_tointeger(L, -1);
   }
-  vm_release(L);
+  luvi_closestate(L);
+  luvi_vmpool_drain();
   return res;
 }
@@ -0,0 +1,65 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "./luvi.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// luvi.memfd(name, data) puts data in an anonymous in-memory file and
+// returns a path that opens it (/proc/self/fd/N) and its fd, so bundled
+// native libraries can be loaded without writing them to disk. The fd is
+// close-on-exec but otherwise stays open until closed with uv.fs_close.
+// Only defined on Linux; returns nil and an error when the kernel doesn't
+// support memfd_create (before 3.17).
+#if defined(__linux__) && defined(SYS_memfd_create)
+#define LUVI_HAVE_MEMFD
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+static int luvi_memfd(lua_State* L) {
+  const char* name = luaL_checkstring(L, 1);
+  size_t len, done = 0;
+  const char* data = luaL_checklstring(L, 2, &len);
+  char path[32];
+  int fd = (int)syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+  if (fd < 0) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "memfd_create: %s", strerror(errno));
+    return 2;
+  }
+  while (done < len) {
+    ssize_t n = write(fd, data + done, len - done);
+    if (n < 0) {
+      int err = errno;
+      if (err == EINTR) continue;
+      close(fd);
+      lua_pushnil(L);
+      lua_pushfstring(L, "memfd write: %s", strerror(err));
+      return 2;
+    }
+    done += (size_t)n;
+  }
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  lua_pushstring(L, path);
+  lua_pushinteger(L, fd);
+  return 2;
+}
+#endif
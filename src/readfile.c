@@ -0,0 +1,156 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "./luvi.h"
+#include <limits.h>
+
+// luvi.readfile(path) reads a whole file with open, fstat, a single read
+// sized from fstat and close, for folder bundles. The read asks for a byte
+// more than the file's size so a file that grew (or reports no size, like
+// those in /proc) is noticed and read on to the end.
+
+static const char* luvi_stat_type(const uv_stat_t* s) {
+  switch (s->st_mode & S_IFMT) {
+    case S_IFREG: return "file";
+    case S_IFDIR: return "directory";
+#ifdef S_IFLNK
+    case S_IFLNK: return "link";
+#endif
+#ifdef S_IFIFO
+    case S_IFIFO: return "fifo";
+#endif
+#ifdef S_IFSOCK
+    case S_IFSOCK: return "socket";
+#endif
+#ifdef S_IFCHR
+    case S_IFCHR: return "char";
+#endif
+#ifdef S_IFBLK
+    case S_IFBLK: return "block";
+#endif
+    default: return "unknown";
+  }
+}
+
+// The same { type, size, mtime = { sec, nsec } } folder bundles return
+static void luvi_push_stat(lua_State* L, const uv_stat_t* s, uint64_t size) {
+  lua_createtable(L, 0, 3);
+  lua_pushstring(L, luvi_stat_type(s));
+  lua_setfield(L, -2, "type");
+  lua_pushinteger(L, size);
+  lua_setfield(L, -2, "size");
+  lua_createtable(L, 0, 2);
+  lua_pushinteger(L, s->st_mtim.tv_sec);
+  lua_setfield(L, -2, "sec");
+  lua_pushinteger(L, s->st_mtim.tv_nsec);
+  lua_setfield(L, -2, "nsec");
+  lua_setfield(L, -2, "mtime");
+}
+
+#define LUVI_READFILE_BUF "luvi.readfile.buf"
+
+static int luvi_readfile_buf_gc(lua_State* L) {
+  char** data = lua_touserdata(L, 1);
+  free(*data);
+  *data = NULL;
+  return 0;
+}
+
+// Returns the contents and the file's stat, nil and the stat for anything
+// that isn't a regular file, or nil and an error.
+static int luvi_readfile(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  uv_loop_t* loop = luv_loop(L);
+  uv_fs_t req;
+  uv_stat_t st;
+  uv_file fd;
+  char* data = NULL;
+  char** owner;
+  size_t len = 0, cap;
+  int err;
+  // The buffer is owned by a userdata, so it is freed by the gc even if
+  // pushing the result raises.
+  owner = lua_newuserdata(L, sizeof(*owner));
+  *owner = NULL;
+  if (luaL_newmetatable(L, LUVI_READFILE_BUF)) {
+    lua_pushcfunction(L, luvi_readfile_buf_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  fd = uv_fs_open(loop, &req, path, O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    err = fd;
+    goto fail;
+  }
+  err = uv_fs_fstat(loop, &req, fd, NULL);
+  st = req.statbuf;
+  uv_fs_req_cleanup(&req);
+  if (err < 0) goto close;
+  if ((st.st_mode & S_IFMT) != S_IFREG) {
+    uv_fs_close(loop, &req, fd, NULL);
+    uv_fs_req_cleanup(&req);
+    lua_pushnil(L);
+    luvi_push_stat(L, &st, st.st_size);
+    return 2;
+  }
+  cap = (size_t)st.st_size + 1;
+  for (;;) {
+    uv_buf_t buf;
+    ssize_t n;
+    size_t want;
+    if (data == NULL || len == cap) {
+      char* grown;
+      if (data != NULL) cap = cap < 4096 ? 4096 : cap * 2;
+      grown = realloc(data, cap);
+      if (grown == NULL) {
+        err = UV_ENOMEM;
+        goto close;
+      }
+      data = *owner = grown;
+    }
+    // uv_buf_t holds at most 4GB, and reads may return less than asked
+    want = cap - len > UINT_MAX ? UINT_MAX : cap - len;
+    buf = uv_buf_init(data + len, (unsigned int)want);
+    n = uv_fs_read(loop, &req, fd, &buf, 1, -1, NULL);
+    uv_fs_req_cleanup(&req);
+    if (n < 0) {
+      err = (int)n;
+      goto close;
+    }
+    len += (size_t)n;
+    // Short of the extra byte once the whole file is in means it's at its end
+    if (n == 0 || (len < cap && len >= (size_t)st.st_size)) break;
+  }
+  uv_fs_close(loop, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  lua_pushlstring(L, data, len);
+  free(data);
+  *owner = NULL;
+  luvi_push_stat(L, &st, len);
+  return 2;
+
+close:
+  free(data);
+  *owner = NULL;
+  uv_fs_close(loop, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+fail:
+  lua_pushnil(L);
+  lua_pushfstring(L, "%s: %s: %s", uv_err_name(err), uv_strerror(err), path);
+  return 2;
+}
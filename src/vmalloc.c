@@ -0,0 +1,417 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "./luvi.h"
+
+// lua_Alloc implementations used for every state luvi creates.
+//
+//  - "slab":    small blocks (up to 512 bytes) come from per-state size class
+//               free lists carved out of 64KB slabs, larger ones from libc.
+//               Slabs are only returned to the system when the state closes.
+//  - "system":  plain libc realloc/free.
+//  - "default": whatever luaL_newstate uses (LuaJIT's internal allocator),
+//               no accounting is available in this mode.
+//
+// The first two keep per-state accounting which is exposed through
+// luvi.vm_memory() and luvi.vm_memory_list(). The allocator is picked with
+// LUVI_ALLOCATOR at startup, the default depends on WITH_SLAB_ALLOC.
+//
+// Each state is only ever used by one thread at a time, so the free lists
+// and counters of a state need no locking. Only the list of all live
+// allocators is shared.
+//
+// A state can be given a memory budget. Growing allocations that would push
+// it over the budget fail, which lua turns into a regular "not enough
+// memory" error inside that state. The budget for the main state comes from
+// LUVI_MEMORY_LIMIT and the one for thread states from
+// LUVI_THREAD_MEMORY_LIMIT, both in bytes with an optional k/m/g suffix.
+
+#define LUVI_ALLOC_ALIGN 16
+#define LUVI_ALLOC_CLASSES 32
+#define LUVI_ALLOC_MAX_SMALL (LUVI_ALLOC_ALIGN * LUVI_ALLOC_CLASSES)
+#define LUVI_ALLOC_SLAB_SIZE (64 * 1024)
+
+enum {
+  LUVI_ALLOC_DEFAULT = 0,
+  LUVI_ALLOC_SYSTEM,
+  LUVI_ALLOC_SLAB
+};
+
+static const char* luvi_alloc_kinds[] = { "default", "system", "slab", NULL };
+
+typedef struct luvi_alloc_block_s {
+  struct luvi_alloc_block_s* next;
+} luvi_alloc_block_t;
+
+typedef union luvi_alloc_slab_s {
+  union luvi_alloc_slab_s* next;
+  char align[LUVI_ALLOC_ALIGN];
+} luvi_alloc_slab_t;
+
+typedef struct luvi_alloc_s {
+  int kind;
+  int main;           // the budget comes from the main state's limit
+  unsigned int id;
+  size_t live;        // bytes currently allocated by the state
+  size_t peak;        // high water mark of live
+  size_t blocks;      // number of live allocations
+  uint64_t allocations; // total number of allocations over the state's life
+  size_t slab_bytes;  // memory reserved for slabs
+  size_t limit;       // memory budget, 0 for none
+  uint64_t limit_hits; // allocations refused because of the budget
+  luvi_alloc_block_t* free[LUVI_ALLOC_CLASSES];
+  luvi_alloc_slab_t* slabs;
+  char* bump;
+  char* bump_end;
+  struct luvi_alloc_s* prev;
+  struct luvi_alloc_s* next;
+} luvi_alloc_t;
+
+static uv_mutex_t luvi_alloc_lock;
+static uv_once_t luvi_alloc_once = UV_ONCE_INIT;
+static luvi_alloc_t* luvi_alloc_list;
+static unsigned int luvi_alloc_next_id;
+static int luvi_alloc_kind;
+static int luvi_alloc_refused; // the engine does not take custom allocators
+static size_t luvi_alloc_main_limit;
+static size_t luvi_alloc_thread_limit;
+static uint64_t luvi_alloc_limit_hits; // across all states, including closed ones
+
+// Parse a byte count like "65536", "512k", "64m" or "2g".
+static size_t luvi_alloc_parse_size(const char* value) {
+  char* end;
+  double size = strtod(value, &end);
+  if (size <= 0) return 0;
+  switch (*end) {
+    case 'k': case 'K': size *= 1024; break;
+    case 'm': case 'M': size *= 1024 * 1024; break;
+    case 'g': case 'G': size *= 1024 * 1024 * 1024; break;
+  }
+  return (size_t)size;
+}
+
+static void luvi_alloc_init(void) {
+  const char* value = getenv("LUVI_ALLOCATOR");
+  int i;
+  uv_mutex_init(&luvi_alloc_lock);
+#ifdef WITH_SLAB_ALLOC
+  luvi_alloc_kind = LUVI_ALLOC_SLAB;
+#else
+  luvi_alloc_kind = LUVI_ALLOC_DEFAULT;
+#endif
+  if (value) {
+    for (i = 0; luvi_alloc_kinds[i]; i++) {
+      if (strcmp(value, luvi_alloc_kinds[i]) == 0) {
+        luvi_alloc_kind = i;
+        break;
+      }
+    }
+  }
+  value = getenv("LUVI_MEMORY_LIMIT");
+  if (value) luvi_alloc_main_limit = luvi_alloc_parse_size(value);
+  value = getenv("LUVI_THREAD_MEMORY_LIMIT");
+  if (value) luvi_alloc_thread_limit = luvi_alloc_parse_size(value);
+  // Budgets need accounting, which the engine's allocator does not have.
+  if (luvi_alloc_kind == LUVI_ALLOC_DEFAULT &&
+      (luvi_alloc_main_limit || luvi_alloc_thread_limit)) {
+    luvi_alloc_kind = LUVI_ALLOC_SYSTEM;
+  }
+}
+
+static void* luvi_alloc_small(luvi_alloc_t* a, size_t size) {
+  unsigned int cls = (unsigned int)((size - 1) / LUVI_ALLOC_ALIGN);
+  size_t block = (size_t)(cls + 1) * LUVI_ALLOC_ALIGN;
+  luvi_alloc_block_t* b = a->free[cls];
+  if (b) {
+    a->free[cls] = b->next;
+    return b;
+  }
+  if ((size_t)(a->bump_end - a->bump) < block) {
+    luvi_alloc_slab_t* slab = malloc(LUVI_ALLOC_SLAB_SIZE);
+    if (slab == NULL) return NULL;
+    slab->next = a->slabs;
+    a->slabs = slab;
+    a->slab_bytes += LUVI_ALLOC_SLAB_SIZE;
+    a->bump = (char*)(slab + 1);
+    a->bump_end = (char*)slab + LUVI_ALLOC_SLAB_SIZE;
+  }
+  b = (luvi_alloc_block_t*)a->bump;
+  a->bump += block;
+  return b;
+}
+
+static void luvi_alloc_small_free(luvi_alloc_t* a, void* ptr, size_t size) {
+  unsigned int cls = (unsigned int)((size - 1) / LUVI_ALLOC_ALIGN);
+  luvi_alloc_block_t* b = ptr;
+  b->next = a->free[cls];
+  a->free[cls] = b;
+}
+
+static void* luvi_alloc_slab_realloc(luvi_alloc_t* a, void* ptr, size_t osize, size_t nsize) {
+  int osmall = osize <= LUVI_ALLOC_MAX_SMALL;
+  int nsmall = nsize <= LUVI_ALLOC_MAX_SMALL;
+  void* nptr;
+  if (ptr == NULL) {
+    return nsmall ? luvi_alloc_small(a, nsize) : malloc(nsize);
+  }
+  if (nsize == 0) {
+    if (osmall) luvi_alloc_small_free(a, ptr, osize);
+    else free(ptr);
+    return NULL;
+  }
+  if (osmall && nsmall &&
+      (osize - 1) / LUVI_ALLOC_ALIGN == (nsize - 1) / LUVI_ALLOC_ALIGN) {
+    return ptr;
+  }
+  if (!osmall && !nsmall) {
+    return realloc(ptr, nsize);
+  }
+  nptr = nsmall ? luvi_alloc_small(a, nsize) : malloc(nsize);
+  if (nptr == NULL) return NULL;
+  memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+  if (osmall) luvi_alloc_small_free(a, ptr, osize);
+  else free(ptr);
+  return nptr;
+}
+
+static void* luvi_alloc_f(void* ud, void* ptr, size_t osize, size_t nsize) {
+  luvi_alloc_t* a = ud;
+  void* nptr;
+  // Lua 5.4 passes the object type in osize for new blocks.
+  if (ptr == NULL) osize = 0;
+  if (a->limit && nsize > osize && a->live + (nsize - osize) > a->limit) {
+    a->limit_hits++;
+    uv_mutex_lock(&luvi_alloc_lock);
+    luvi_alloc_limit_hits++;
+    uv_mutex_unlock(&luvi_alloc_lock);
+    return NULL;
+  }
+  if (a->kind == LUVI_ALLOC_SLAB) {
+    nptr = luvi_alloc_slab_realloc(a, ptr, osize, nsize);
+  } else if (nsize == 0) {
+    free(ptr);
+    nptr = NULL;
+  } else {
+    nptr = realloc(ptr, nsize);
+  }
+  if (nptr == NULL && nsize > 0) return NULL;
+  a->live += nsize;
+  a->live -= osize;
+  if (ptr == NULL) {
+    a->blocks++;
+    a->allocations++;
+  } else if (nsize == 0) {
+    a->blocks--;
+  }
+  if (a->live > a->peak) a->peak = a->live;
+  return nptr;
+}
+
+static int luvi_alloc_panic(lua_State* L) {
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+    lua_tostring(L, -1));
+  return 0;
+}
+
+// Create a new lua state using the configured allocator.
+static lua_State* luvi_newstate(void) {
+  luvi_alloc_t* a;
+  lua_State* L;
+  int kind;
+  uv_once(&luvi_alloc_once, luvi_alloc_init);
+  uv_mutex_lock(&luvi_alloc_lock);
+  kind = luvi_alloc_refused ? LUVI_ALLOC_DEFAULT : luvi_alloc_kind;
+  uv_mutex_unlock(&luvi_alloc_lock);
+  if (kind == LUVI_ALLOC_DEFAULT) {
+    return luaL_newstate();
+  }
+  a = calloc(1, sizeof(*a));
+  if (a == NULL) return NULL;
+  a->kind = kind;
+  L = lua_newstate(luvi_alloc_f, a);
+  if (L == NULL) {
+    // LuaJIT without GC64 refuses custom allocators on 64 bit platforms and
+    // complains on stderr each time, so only try once.
+    free(a);
+    uv_mutex_lock(&luvi_alloc_lock);
+    luvi_alloc_refused = 1;
+    uv_mutex_unlock(&luvi_alloc_lock);
+    return luaL_newstate();
+  }
+  lua_atpanic(L, luvi_alloc_panic);
+  uv_mutex_lock(&luvi_alloc_lock);
+  a->id = ++luvi_alloc_next_id;
+  a->next = luvi_alloc_list;
+  if (luvi_alloc_list) luvi_alloc_list->prev = a;
+  luvi_alloc_list = a;
+  uv_mutex_unlock(&luvi_alloc_lock);
+  return L;
+}
+
+static luvi_alloc_t* luvi_alloc_get(lua_State* L) {
+  void* ud;
+  if (lua_getallocf(L, &ud) != luvi_alloc_f) return NULL;
+  return ud;
+}
+
+// Apply the configured budget to a state. Called once the builtin modules
+// are loaded, so a small budget can not break the state's setup, and again
+// each time a pooled thread state is handed out.
+static void luvi_alloc_apply_limit(lua_State* L, int main_vm) {
+  luvi_alloc_t* a = luvi_alloc_get(L);
+  if (a == NULL) return;
+  uv_mutex_lock(&luvi_alloc_lock);
+  a->main = main_vm;
+  a->limit = main_vm ? luvi_alloc_main_limit : luvi_alloc_thread_limit;
+  uv_mutex_unlock(&luvi_alloc_lock);
+}
+
+// Close a state created by luvi_newstate and release its allocator.
+static void luvi_closestate(lua_State* L) {
+  luvi_alloc_t* a = luvi_alloc_get(L);
+  luvi_alloc_slab_t* slab;
+  lua_close(L);
+  if (a == NULL) return;
+  uv_mutex_lock(&luvi_alloc_lock);
+  if (a->prev) a->prev->next = a->next;
+  else luvi_alloc_list = a->next;
+  if (a->next) a->next->prev = a->prev;
+  uv_mutex_unlock(&luvi_alloc_lock);
+  while ((slab = a->slabs)) {
+    a->slabs = slab->next;
+    free(slab);
+  }
+  free(a);
+}
+
+static void luvi_alloc_push(lua_State* L, const luvi_alloc_t* a) {
+  lua_createtable(L, 0, 9);
+  lua_pushinteger(L, a->id);
+  lua_setfield(L, -2, "id");
+  lua_pushstring(L, luvi_alloc_kinds[a->kind]);
+  lua_setfield(L, -2, "allocator");
+  lua_pushnumber(L, (lua_Number)a->live);
+  lua_setfield(L, -2, "live");
+  lua_pushnumber(L, (lua_Number)a->peak);
+  lua_setfield(L, -2, "peak");
+  lua_pushnumber(L, (lua_Number)a->blocks);
+  lua_setfield(L, -2, "blocks");
+  lua_pushnumber(L, (lua_Number)a->allocations);
+  lua_setfield(L, -2, "allocations");
+  lua_pushnumber(L, (lua_Number)a->slab_bytes);
+  lua_setfield(L, -2, "slab_bytes");
+  lua_pushnumber(L, (lua_Number)a->limit);
+  lua_setfield(L, -2, "limit");
+  lua_pushnumber(L, (lua_Number)a->limit_hits);
+  lua_setfield(L, -2, "limit_hits");
+}
+
+// Accounting for the calling state.
+static int luvi_vm_memory(lua_State* L) {
+  luvi_alloc_t* a = luvi_alloc_get(L);
+  if (a == NULL) {
+    lua_createtable(L, 0, 2);
+    lua_pushstring(L, luvi_alloc_kinds[LUVI_ALLOC_DEFAULT]);
+    lua_setfield(L, -2, "allocator");
+    lua_pushnumber(L, (lua_Number)lua_gc(L, LUA_GCCOUNT, 0) * 1024 +
+      lua_gc(L, LUA_GCCOUNTB, 0));
+    lua_setfield(L, -2, "live");
+    return 1;
+  }
+  luvi_alloc_push(L, a);
+  return 1;
+}
+
+// Accounting for every live state in the process. Counters of states owned
+// by other threads are read without synchronisation and are approximate.
+static int luvi_vm_memory_list(lua_State* L) {
+  luvi_alloc_t* a;
+  luvi_alloc_t* copies;
+  size_t i, count = 0;
+  uv_once(&luvi_alloc_once, luvi_alloc_init);
+  uv_mutex_lock(&luvi_alloc_lock);
+  for (a = luvi_alloc_list; a; a = a->next) count++;
+  uv_mutex_unlock(&luvi_alloc_lock);
+  // Allocate outside of the lock since it may raise a memory error.
+  copies = lua_newuserdata(L, (count ? count : 1) * sizeof(*copies));
+  uv_mutex_lock(&luvi_alloc_lock);
+  for (i = 0, a = luvi_alloc_list; a && i < count; a = a->next) {
+    copies[i++] = *a;
+  }
+  uv_mutex_unlock(&luvi_alloc_lock);
+  count = i;
+  lua_createtable(L, (int)count, 0);
+  for (i = 0; i < count; i++) {
+    luvi_alloc_push(L, &copies[i]);
+    lua_rawseti(L, -2, (int)i + 1);
+  }
+  return 1;
+}
+
+static size_t luvi_alloc_check_size(lua_State* L, int index) {
+  if (lua_type(L, index) == LUA_TNUMBER) {
+    lua_Number size = lua_tonumber(L, index);
+    return size > 0 ? (size_t)size : 0;
+  }
+  return luvi_alloc_parse_size(luaL_checkstring(L, index));
+}
+
+// Set the budget of the calling state, 0 removes it.
+static int luvi_set_vm_memory_limit(lua_State* L) {
+  luvi_alloc_t* a = luvi_alloc_get(L);
+  size_t limit = luvi_alloc_check_size(L, 1);
+  if (a == NULL) {
+    return luaL_error(L, "memory limits need accounting, this state uses the default allocator");
+  }
+  uv_mutex_lock(&luvi_alloc_lock);
+  a->limit = limit;
+  if (a->main) luvi_alloc_main_limit = limit;
+  uv_mutex_unlock(&luvi_alloc_lock);
+  return 0;
+}
+
+// Set the budget of thread states acquired from now on, 0 removes it.
+static int luvi_set_thread_memory_limit(lua_State* L) {
+  size_t limit = luvi_alloc_check_size(L, 1);
+  uv_once(&luvi_alloc_once, luvi_alloc_init);
+  uv_mutex_lock(&luvi_alloc_lock);
+  luvi_alloc_thread_limit = limit;
+  if (limit && luvi_alloc_kind == LUVI_ALLOC_DEFAULT) {
+    luvi_alloc_kind = LUVI_ALLOC_SYSTEM;
+  }
+  uv_mutex_unlock(&luvi_alloc_lock);
+  return 0;
+}
+
+static int luvi_vm_memory_limits(lua_State* L) {
+  size_t main_limit, thread_limit;
+  uint64_t hits;
+  uv_once(&luvi_alloc_once, luvi_alloc_init);
+  uv_mutex_lock(&luvi_alloc_lock);
+  main_limit = luvi_alloc_main_limit;
+  thread_limit = luvi_alloc_thread_limit;
+  hits = luvi_alloc_limit_hits;
+  uv_mutex_unlock(&luvi_alloc_lock);
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, (lua_Number)main_limit);
+  lua_setfield(L, -2, "main");
+  lua_pushnumber(L, (lua_Number)thread_limit);
+  lua_setfield(L, -2, "thread");
+  lua_pushnumber(L, (lua_Number)hits);
+  lua_setfield(L, -2, "hits");
+  return 1;
+}
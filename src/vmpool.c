@@ -0,0 +1,382 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "./luvi.h"
+
+// Pool of warm lua states handed out to luv for uv.new_thread / uv.new_work.
+//
+// A state only enters the pool if it was marked right after creation, which
+// records in the registry a copy of _G, package.loaded, package.preload and
+// of every table directly in _G or package.loaded (the standard libraries,
+// uv, ...) with their metatables, and of the registry itself. On release the
+// state is rolled back to that snapshot, which also drops registry entries
+// made since, its stack cleared and a full gc cycle run. Changes deeper than
+// that, like fields of tables inside a module or upvalues of its functions,
+// carry over, so jobs must not change shared modules. States whose loop
+// still has live handles are never reused.
+//
+// Configured with LUVI_VM_POOL_SIZE (0 disables the pool, the default) and
+// LUVI_VM_POOL_IDLE (milliseconds a state may sit idle before it is closed,
+// 0 keeps them forever), or at runtime through luvi.vm_pool_configure.
+
+#define LUVI_VMPOOL_MAX 64
+#define LUVI_VMPOOL_SNAPSHOT "luvi.vmpool.snapshot"
+
+typedef struct {
+  lua_State* L;
+  uint64_t released; // uv_hrtime() when the state was put back
+} luvi_vmpool_entry_t;
+
+typedef struct {
+  uv_mutex_t lock;
+  unsigned int size;
+  uint64_t idle_timeout; // in ns, 0 means never trim
+  unsigned int count;
+  luvi_vmpool_entry_t entries[LUVI_VMPOOL_MAX];
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t resets;
+  uint64_t discards;
+  uint64_t trims;
+} luvi_vmpool_t;
+
+static luvi_vmpool_t luvi_vmpool;
+static uv_once_t luvi_vmpool_once = UV_ONCE_INIT;
+
+static void luvi_vmpool_init(void) {
+  const char* value;
+  memset(&luvi_vmpool, 0, sizeof(luvi_vmpool));
+  uv_mutex_init(&luvi_vmpool.lock);
+  value = getenv("LUVI_VM_POOL_SIZE");
+  if (value) {
+    int size = atoi(value);
+    if (size < 0) size = 0;
+    if (size > LUVI_VMPOOL_MAX) size = LUVI_VMPOOL_MAX;
+    luvi_vmpool.size = size;
+  }
+  value = getenv("LUVI_VM_POOL_IDLE");
+  if (value) {
+    long idle = atol(value);
+    if (idle > 0) luvi_vmpool.idle_timeout = (uint64_t)idle * 1000000;
+  }
+}
+
+// Close states that have been idle for longer than the timeout, or that no
+// longer fit after the pool was shrunk. Must be called with the lock held;
+// the closed states are collected into `out` so they can be closed outside.
+static unsigned int luvi_vmpool_trim_locked(lua_State** out) {
+  unsigned int i, kept = 0, trimmed = 0;
+  uint64_t now = uv_hrtime();
+  for (i = 0; i < luvi_vmpool.count; i++) {
+    luvi_vmpool_entry_t* entry = &luvi_vmpool.entries[i];
+    int expired = luvi_vmpool.idle_timeout &&
+      now - entry->released > luvi_vmpool.idle_timeout;
+    if (expired || kept >= luvi_vmpool.size) {
+      out[trimmed++] = entry->L;
+    } else {
+      luvi_vmpool.entries[kept++] = *entry;
+    }
+  }
+  luvi_vmpool.count = kept;
+  luvi_vmpool.trims += trimmed;
+  return trimmed;
+}
+
+static void luvi_vmpool_close_all(lua_State** states, unsigned int count) {
+  unsigned int i;
+  for (i = 0; i < count; i++) {
+    luvi_closestate(states[i]);
+  }
+}
+
+// Copy every key/value of the table at `idx` into a new table on the stack.
+static void luvi_vmpool_copy_table(lua_State* L, int idx) {
+  lua_newtable(L);
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    lua_pushvalue(L, -2);
+    lua_insert(L, -2);
+    lua_rawset(L, -4);
+  }
+}
+
+// Make the table at `live` match the table at `snap` key by key.
+static void luvi_vmpool_restore_table(lua_State* L, int live, int snap) {
+  lua_pushnil(L);
+  while (lua_next(L, live)) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, snap);
+    if (!lua_rawequal(L, -1, -2)) {
+      // Assigning to an existing field is allowed while traversing.
+      lua_pushvalue(L, -3);
+      lua_insert(L, -2);
+      lua_rawset(L, live);
+    } else {
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pushnil(L);
+  while (lua_next(L, snap)) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, live);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, live);
+    } else {
+      lua_pop(L, 2);
+    }
+  }
+}
+
+// Record a copy of the table at `idx` in `tables` and its metatable in
+// `metas`, both keyed by the table. Tables seen before are skipped.
+static void luvi_vmpool_record(lua_State* L, int tables, int metas, int idx) {
+  lua_pushvalue(L, idx);
+  lua_rawget(L, tables);
+  if (!lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+  lua_pop(L, 1);
+  lua_pushvalue(L, idx);
+  luvi_vmpool_copy_table(L, idx);
+  lua_rawset(L, tables);
+  if (lua_getmetatable(L, idx)) {
+    lua_pushvalue(L, idx);
+    lua_insert(L, -2);
+    lua_rawset(L, metas);
+  }
+}
+
+// Record every table directly in the table at `idx`.
+static void luvi_vmpool_record_fields(lua_State* L, int tables, int metas, int idx) {
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    if (lua_istable(L, -1)) {
+      luvi_vmpool_record(L, tables, metas, lua_gettop(L));
+    }
+    lua_pop(L, 1);
+  }
+}
+
+static int luvi_vmpool_snapshot(lua_State* L) {
+  int snap, tables, metas, globals, loaded, preload;
+  lua_newtable(L);
+  snap = lua_gettop(L);
+  lua_newtable(L);
+  tables = lua_gettop(L);
+  lua_newtable(L);
+  metas = lua_gettop(L);
+  lua_pushglobaltable(L);
+  globals = lua_gettop(L);
+  lua_getfield(L, globals, "package");
+  lua_getfield(L, -1, "loaded");
+  loaded = lua_gettop(L);
+  lua_getfield(L, loaded - 1, "preload");
+  preload = lua_gettop(L);
+  luvi_vmpool_record(L, tables, metas, globals);
+  luvi_vmpool_record(L, tables, metas, loaded);
+  luvi_vmpool_record(L, tables, metas, preload);
+  luvi_vmpool_record_fields(L, tables, metas, globals);
+  luvi_vmpool_record_fields(L, tables, metas, loaded);
+  lua_settop(L, metas);
+  lua_setfield(L, snap, "metas");
+  lua_setfield(L, snap, "tables");
+  // The registry copy is taken last so it includes the snapshot itself
+  lua_pushvalue(L, snap);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUVI_VMPOOL_SNAPSHOT);
+  luvi_vmpool_copy_table(L, LUA_REGISTRYINDEX);
+  lua_setfield(L, snap, "registry");
+  lua_pop(L, 1);
+  return 0;
+}
+
+static int luvi_vmpool_reset(lua_State* L) {
+  int snap, tables, metas;
+  lua_getfield(L, LUA_REGISTRYINDEX, LUVI_VMPOOL_SNAPSHOT);
+  snap = lua_gettop(L);
+  lua_getfield(L, snap, "tables");
+  tables = lua_gettop(L);
+  lua_getfield(L, snap, "metas");
+  metas = lua_gettop(L);
+  lua_pushnil(L);
+  while (lua_next(L, tables)) {
+    int live = lua_gettop(L) - 1;
+    luvi_vmpool_restore_table(L, live, live + 1);
+    lua_pushvalue(L, live);
+    lua_rawget(L, metas);
+    lua_setmetatable(L, live);
+    lua_pop(L, 1);
+  }
+  lua_getfield(L, snap, "registry");
+  luvi_vmpool_restore_table(L, LUA_REGISTRYINDEX, lua_gettop(L));
+  lua_pop(L, 4);
+  lua_gc(L, LUA_GCRESTART, 0);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  return 0;
+}
+
+// The size can change from any thread through luvi.vm_pool_configure.
+static unsigned int luvi_vmpool_size(void) {
+  unsigned int size;
+  uv_once(&luvi_vmpool_once, luvi_vmpool_init);
+  uv_mutex_lock(&luvi_vmpool.lock);
+  size = luvi_vmpool.size;
+  uv_mutex_unlock(&luvi_vmpool.lock);
+  return size;
+}
+
+// Record the pristine state of a freshly created thread VM so it can later
+// be recycled. States created while the pool is disabled are left unmarked
+// and will always be closed on release.
+static void luvi_vmpool_mark(lua_State* L) {
+  if (luvi_vmpool_size() == 0) return;
+  lua_pushcfunction(L, luvi_vmpool_snapshot);
+  if (lua_pcall(L, 0, 0, 0)) {
+    lua_pop(L, 1);
+  }
+}
+
+// Returns a warm state from the pool or NULL if none is available.
+static lua_State* luvi_vmpool_get(void) {
+  lua_State* trimmed[LUVI_VMPOOL_MAX];
+  unsigned int ntrimmed;
+  lua_State* L = NULL;
+  uv_once(&luvi_vmpool_once, luvi_vmpool_init);
+  uv_mutex_lock(&luvi_vmpool.lock);
+  ntrimmed = luvi_vmpool_trim_locked(trimmed);
+  if (luvi_vmpool.count > 0) {
+    // Most recently released first, it is the most likely to be cache-hot.
+    L = luvi_vmpool.entries[--luvi_vmpool.count].L;
+    luvi_vmpool.hits++;
+  } else {
+    luvi_vmpool.misses++;
+  }
+  uv_mutex_unlock(&luvi_vmpool.lock);
+  luvi_vmpool_close_all(trimmed, ntrimmed);
+  return L;
+}
+
+// Try to reset the state and return it to the pool. Returns 0 when the state
+// was not taken and the caller needs to close it.
+static int luvi_vmpool_put(lua_State* L) {
+  lua_State* trimmed[LUVI_VMPOOL_MAX];
+  unsigned int ntrimmed;
+  int taken = 0;
+  if (luvi_vmpool_size() == 0) return 0;
+
+  lua_settop(L, 0);
+  lua_getfield(L, LUA_REGISTRYINDEX, LUVI_VMPOOL_SNAPSHOT);
+  if (lua_isnil(L, -1) || uv_loop_alive(luv_loop(L))) {
+    lua_pop(L, 1);
+    uv_mutex_lock(&luvi_vmpool.lock);
+    luvi_vmpool.discards++;
+    uv_mutex_unlock(&luvi_vmpool.lock);
+    return 0;
+  }
+  lua_pop(L, 1);
+  lua_sethook(L, NULL, 0, 0);
+  lua_pushcfunction(L, luvi_vmpool_reset);
+  if (lua_pcall(L, 0, 0, 0)) {
+    lua_settop(L, 0);
+    uv_mutex_lock(&luvi_vmpool.lock);
+    luvi_vmpool.discards++;
+    uv_mutex_unlock(&luvi_vmpool.lock);
+    return 0;
+  }
+
+  uv_mutex_lock(&luvi_vmpool.lock);
+  luvi_vmpool.resets++;
+  ntrimmed = luvi_vmpool_trim_locked(trimmed);
+  if (luvi_vmpool.count < luvi_vmpool.size) {
+    luvi_vmpool_entry_t* entry = &luvi_vmpool.entries[luvi_vmpool.count++];
+    entry->L = L;
+    entry->released = uv_hrtime();
+    taken = 1;
+  } else {
+    luvi_vmpool.discards++;
+  }
+  uv_mutex_unlock(&luvi_vmpool.lock);
+  luvi_vmpool_close_all(trimmed, ntrimmed);
+  return taken;
+}
+
+// Close every pooled state, used at process shutdown.
+static void luvi_vmpool_drain(void) {
+  lua_State* states[LUVI_VMPOOL_MAX];
+  unsigned int i, count;
+  uv_once(&luvi_vmpool_once, luvi_vmpool_init);
+  uv_mutex_lock(&luvi_vmpool.lock);
+  count = luvi_vmpool.count;
+  for (i = 0; i < count; i++) {
+    states[i] = luvi_vmpool.entries[i].L;
+  }
+  luvi_vmpool.count = 0;
+  uv_mutex_unlock(&luvi_vmpool.lock);
+  luvi_vmpool_close_all(states, count);
+}
+
+static int luvi_vm_pool_stats(lua_State* L) {
+  lua_State* trimmed[LUVI_VMPOOL_MAX];
+  unsigned int ntrimmed;
+  luvi_vmpool_t stats;
+  uv_once(&luvi_vmpool_once, luvi_vmpool_init);
+  uv_mutex_lock(&luvi_vmpool.lock);
+  ntrimmed = luvi_vmpool_trim_locked(trimmed);
+  stats = luvi_vmpool;
+  uv_mutex_unlock(&luvi_vmpool.lock);
+  luvi_vmpool_close_all(trimmed, ntrimmed);
+
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, stats.size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, (lua_Integer)(stats.idle_timeout / 1000000));
+  lua_setfield(L, -2, "idle");
+  lua_pushinteger(L, stats.count);
+  lua_setfield(L, -2, "pooled");
+  lua_pushnumber(L, (lua_Number)stats.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, (lua_Number)stats.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, (lua_Number)stats.resets);
+  lua_setfield(L, -2, "resets");
+  lua_pushnumber(L, (lua_Number)stats.discards);
+  lua_setfield(L, -2, "discards");
+  lua_pushnumber(L, (lua_Number)stats.trims);
+  lua_setfield(L, -2, "trims");
+  return 1;
+}
+
+static int luvi_vm_pool_configure(lua_State* L) {
+  lua_State* trimmed[LUVI_VMPOOL_MAX];
+  unsigned int ntrimmed;
+  lua_Integer size = luaL_checkinteger(L, 1);
+  lua_Integer idle = luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, size >= 0 && size <= LUVI_VMPOOL_MAX, 1, "pool size out of range");
+  luaL_argcheck(L, idle >= 0, 2, "idle timeout must not be negative");
+  uv_once(&luvi_vmpool_once, luvi_vmpool_init);
+  uv_mutex_lock(&luvi_vmpool.lock);
+  luvi_vmpool.size = (unsigned int)size;
+  luvi_vmpool.idle_timeout = (uint64_t)idle * 1000000;
+  ntrimmed = luvi_vmpool_trim_locked(trimmed);
+  uv_mutex_unlock(&luvi_vmpool.lock);
+  luvi_vmpool_close_all(trimmed, ntrimmed);
+  return luvi_vm_pool_stats(L);
+}